@@ -0,0 +1,50 @@
+#include "FrameArena.h"
+
+#include <cassert>
+#include <malloc.h>
+#include <new>
+
+FrameArena::FrameArena()
+{
+	memory = nullptr;
+	capacity = 0;
+	used = 0;
+}
+
+FrameArena::~FrameArena()
+{
+	_aligned_free(memory);
+}
+
+void FrameArena::Reset(size_t bytes)
+{
+	used = 0;
+
+	if (bytes <= capacity)
+	{
+		return;
+	}
+
+	_aligned_free(memory);
+
+	capacity = AlignedSize(bytes);
+	memory = (unsigned char*)_aligned_malloc(capacity, ARENA_ALIGNMENT);
+
+	// Fail here rather than bump a null pointer in the next Allocate
+	if (memory == nullptr)
+	{
+		capacity = 0;
+		throw std::bad_alloc();
+	}
+}
+
+void* FrameArena::Allocate(size_t bytes)
+{
+	size_t alignedBytes = AlignedSize(bytes);
+	assert(used + alignedBytes <= capacity);
+
+	void* allocation = memory + used;
+	used += alignedBytes;
+
+	return allocation;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+
+// Alignment of every arena allocation, one cache line
+#define ARENA_ALIGNMENT 64
+
+// Linear allocator holding the data of a single frame in one contiguous block.
+// Everything is released at once when the arena is reset for the next frame, and
+// the block is only reallocated when a frame needs more than it holds.
+class FrameArena
+{
+public:
+	FrameArena();
+	~FrameArena();
+
+	// Discard all allocations and make room for at least the given bytes
+	void Reset(size_t bytes);
+
+	// Carve the next allocation out of the block reserved by Reset
+	void* Allocate(size_t bytes);
+
+	template<typename T>
+	T* AllocateArray(size_t count) { return static_cast<T*>(Allocate(sizeof(T) * count)); }
+
+	size_t GetCapacity() const { return capacity; }
+	size_t GetUsed() const { return used; }
+
+	// Bytes an allocation occupies once rounded up to the arena alignment
+	static size_t AlignedSize(size_t bytes) { return (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT; }
+
+	template<typename T>
+	static size_t ArraySize(size_t count) { return AlignedSize(sizeof(T) * count); }
+
+private:
+	FrameArena(const FrameArena&);
+	FrameArena& operator=(const FrameArena&);
+
+	unsigned char* memory;
+	size_t capacity;
+	size_t used;
+};
@@ -0,0 +1,70 @@
+#include "FrameThrottle.h"
+
+FrameThrottle::FrameThrottle(int maxFrames, size_t byteBudget)
+{
+	maxFramesInFlight = maxFrames;
+	maxBytesInFlight = byteBudget;
+
+	framesInFlight = 0;
+	bytesInFlight = 0;
+	peakBytesInFlight = 0;
+}
+
+FrameThrottle::~FrameThrottle()
+{
+}
+
+bool FrameThrottle::HasRoom(size_t frameBytes) const
+{
+	if (maxFramesInFlight > 0 && framesInFlight >= maxFramesInFlight)
+	{
+		return false;
+	}
+
+	if (maxBytesInFlight > 0 && framesInFlight > 0 && bytesInFlight + frameBytes > maxBytesInFlight)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+void FrameThrottle::Acquire(size_t frameBytes)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (!HasRoom(frameBytes))
+	{
+		frameReleased.wait(lock);
+	}
+
+	framesInFlight++;
+	bytesInFlight += frameBytes;
+
+	if (bytesInFlight > peakBytesInFlight)
+	{
+		peakBytesInFlight = bytesInFlight;
+	}
+}
+
+void FrameThrottle::Release(size_t frameBytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	framesInFlight--;
+	bytesInFlight -= frameBytes;
+
+	frameReleased.notify_all();
+}
+
+int FrameThrottle::GetFramesInFlight()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return framesInFlight;
+}
+
+size_t FrameThrottle::GetPeakBytesInFlight()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return peakBytesInFlight;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+
+// Limits how many frames the producer may have queued or rendering at once, by
+// count and by the bytes they hold. The producer blocks in Acquire until a
+// finishing frame makes room.
+class FrameThrottle
+{
+public:
+	// A limit of 0 disables that limit
+	FrameThrottle(int maxFrames, size_t byteBudget);
+	~FrameThrottle();
+
+	// Block until a frame of the given size fits within both limits. A single
+	// frame larger than the byte budget is still let through once nothing else is in flight.
+	void Acquire(size_t frameBytes);
+
+	// Return a finished frame's slot and bytes
+	void Release(size_t frameBytes);
+
+	int GetFramesInFlight();
+	size_t GetPeakBytesInFlight();
+
+private:
+	bool HasRoom(size_t frameBytes) const;
+
+	int maxFramesInFlight;
+	size_t maxBytesInFlight;
+
+	int framesInFlight;
+	size_t bytesInFlight;
+	size_t peakBytesInFlight;
+
+	std::mutex mutex;
+	std::condition_variable frameReleased;
+};
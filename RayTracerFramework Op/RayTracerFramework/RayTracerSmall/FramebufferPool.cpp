@@ -0,0 +1,116 @@
+#include "FramebufferPool.h"
+
+#include <new>
+
+#include "ThreadManager.h"
+
+FramebufferPool::FramebufferPool(size_t pixelCount, bool useLargePages)
+{
+	framebufferBytes = sizeof(Vec3f) * pixelCount;
+	largePages = useLargePages && EnableLargePages();
+}
+
+FramebufferPool::~FramebufferPool()
+{
+	for (size_t i = 0; i < allFramebuffers.size(); i++)
+	{
+		ThreadManager::FreeLocal(allFramebuffers[i].pixels);
+	}
+}
+
+bool FramebufferPool::EnableLargePages()
+{
+	HANDLE token;
+
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+	{
+		return false;
+	}
+
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+	bool enabled = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+		&& GetLastError() == ERROR_SUCCESS;
+
+	CloseHandle(token);
+
+	return enabled;
+}
+
+Vec3f* FramebufferPool::Allocate(int &index)
+{
+	Vec3f* pixels = nullptr;
+
+	if (largePages)
+	{
+		pixels = (Vec3f*)ThreadManager::AllocateLocal(framebufferBytes, true);
+	}
+
+	// Fall back to normal pages if no large pages are left
+	if (pixels == nullptr)
+	{
+		pixels = (Vec3f*)ThreadManager::AllocateLocal(framebufferBytes);
+	}
+
+	// Fail like the plain new Vec3f[] it replaces rather than hand out no framebuffer
+	if (pixels == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	Framebuffer framebuffer;
+	framebuffer.pixels = pixels;
+	framebuffer.node = ThreadManager::GetCurrentNumaNode();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	index = (int)allFramebuffers.size();
+	allFramebuffers.push_back(framebuffer);
+
+	return pixels;
+}
+
+Vec3f* FramebufferPool::Acquire(int &index)
+{
+	int node = ThreadManager::GetCurrentNumaNode();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (!freeFramebuffers.empty())
+		{
+			size_t chosen = freeFramebuffers.size() - 1;
+
+			for (size_t i = 0; i < freeFramebuffers.size(); i++)
+			{
+				if (allFramebuffers[freeFramebuffers[i]].node == node)
+				{
+					chosen = i;
+					break;
+				}
+			}
+
+			index = freeFramebuffers[chosen];
+			freeFramebuffers[chosen] = freeFramebuffers.back();
+			freeFramebuffers.pop_back();
+
+			return allFramebuffers[index].pixels;
+		}
+	}
+
+	return Allocate(index);
+}
+
+void FramebufferPool::Release(int index)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	freeFramebuffers.push_back(index);
+}
+
+int FramebufferPool::GetAllocatedCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return (int)allFramebuffers.size();
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#include "Structures.h"
+
+// Framebuffers reused across frames. Render tasks check one out and return it
+// once the frame has been written, so steady-state rendering performs no large
+// allocations and no page faults. The pool only grows to the number of frames
+// in flight.
+class FramebufferPool
+{
+public:
+	FramebufferPool(size_t pixelCount, bool useLargePages);
+	~FramebufferPool();
+
+	// Check out a framebuffer, preferring one on the calling worker's NUMA node.
+	// A new framebuffer is only allocated when none are free. Its index in the pool
+	// is written to index and hands it back to Release.
+	Vec3f* Acquire(int &index);
+
+	// Return the framebuffer with the given pool index
+	void Release(int index);
+
+	int GetAllocatedCount();
+	bool UsingLargePages() const { return largePages; }
+
+private:
+	struct Framebuffer
+	{
+		Vec3f* pixels;
+		int node;
+	};
+
+	// Allow the process to lock large pages, returns false if the privilege is not held
+	static bool EnableLargePages();
+
+	Vec3f* Allocate(int &index);
+
+	size_t framebufferBytes;
+	bool largePages;
+
+	std::vector<Framebuffer> allFramebuffers;
+	std::vector<int> freeFramebuffers; // indices into allFramebuffers
+
+	std::mutex mutex;
+};
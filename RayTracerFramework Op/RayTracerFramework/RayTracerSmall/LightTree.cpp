@@ -0,0 +1,196 @@
+#include "LightTree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+#include "SceneSnapshot.h"
+
+// Orders lights by their center along one axis
+struct LightCenterLess
+{
+	const SphereGeometry* geometry;
+	int axis;
+
+	bool operator()(unsigned a, unsigned b) const { return Axis(geometry[a].center, axis) < Axis(geometry[b].center, axis); }
+};
+
+// Brightness of an emitter, the weight it is picked by
+static float EmitterPower(const SphereMaterial &material)
+{
+	return material.emissionColor.x + material.emissionColor.y + material.emissionColor.z;
+}
+
+LightTree::LightTree()
+{
+	nodes = nullptr;
+	nodeCount = 0;
+	geometry = nullptr;
+	materials = nullptr;
+	lightIndices = nullptr;
+}
+
+size_t LightTree::GetFrameBytes(size_t lightCount)
+{
+	size_t maxNodes = lightCount > 0 ? 2 * lightCount - 1 : 0;
+
+	return FrameArena::ArraySize<LightTreeNode>(maxNodes) + FrameArena::ArraySize<unsigned>(lightCount);
+}
+
+void LightTree::Build(const SphereGeometry* sphereGeometry, const SphereMaterial* sphereMaterials, const unsigned* lights, unsigned lightCount, FrameArena &arena)
+{
+	nodeCount = 0;
+
+	if (lightCount == 0)
+	{
+		return;
+	}
+
+	geometry = sphereGeometry;
+	materials = sphereMaterials;
+
+	nodes = arena.AllocateArray<LightTreeNode>(2 * lightCount - 1);
+	lightIndices = arena.AllocateArray<unsigned>(lightCount);
+	memcpy(lightIndices, lights, sizeof(unsigned) * lightCount);
+
+	nodeCount = 1;
+	BuildNode(0, 0, lightCount);
+}
+
+void LightTree::BuildNode(int nodeIndex, unsigned first, unsigned count)
+{
+	LightTreeNode &node = nodes[nodeIndex];
+
+	if (count == 1)
+	{
+		node.center = geometry[lightIndices[first]].center;
+		node.radius = 0;
+		node.power = EmitterPower(materials[lightIndices[first]]);
+		node.left = -1;
+		node.light = lightIndices[first];
+		return;
+	}
+
+	// Split at the median of the widest axis of the centers
+	Vec3f boundsMin = geometry[lightIndices[first]].center, boundsMax = boundsMin;
+
+	for (unsigned i = first + 1; i < first + count; i++)
+	{
+		const Vec3f &center = geometry[lightIndices[i]].center;
+		boundsMin = Vec3f(FloatMin(boundsMin.x, center.x), FloatMin(boundsMin.y, center.y), FloatMin(boundsMin.z, center.z));
+		boundsMax = Vec3f(FloatMax(boundsMax.x, center.x), FloatMax(boundsMax.y, center.y), FloatMax(boundsMax.z, center.z));
+	}
+
+	Vec3f extent = boundsMax - boundsMin;
+	LightCenterLess less;
+	less.geometry = geometry;
+	less.axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+	unsigned leftCount = count / 2;
+	std::nth_element(lightIndices + first, lightIndices + first + leftCount, lightIndices + first + count, less);
+
+	int left = nodeCount;
+	nodeCount += 2;
+	node.left = left;
+	node.light = 0;
+
+	BuildNode(left, first, leftCount);
+	BuildNode(left + 1, first + leftCount, count - leftCount);
+
+	// Smallest sphere around the two child spheres
+	const LightTreeNode &a = nodes[left];
+	const LightTreeNode &b = nodes[left + 1];
+	Vec3f offset = b.center - a.center;
+	float distance = offset.length();
+
+	if (distance + b.radius <= a.radius)
+	{
+		node.center = a.center;
+		node.radius = a.radius;
+	}
+	else if (distance + a.radius <= b.radius)
+	{
+		node.center = b.center;
+		node.radius = b.radius;
+	}
+	else
+	{
+		node.radius = (distance + a.radius + b.radius) * 0.5f;
+		node.center = a.center + offset * ((node.radius - a.radius) / distance);
+	}
+
+	node.power = a.power + b.power;
+}
+
+float LightTree::Importance(const LightTreeNode &node, const Vec3f &phit, const Vec3f &nhit) const
+{
+	Vec3f toNode = node.center - phit;
+	float distance2 = toNode.length2();
+
+	// Some light below may lie in any direction from a point inside the bounds
+	if (distance2 <= node.radius * node.radius)
+	{
+		return node.power;
+	}
+
+	float distance = sqrtf(distance2);
+	float cosTheta = nhit.dot(toNode) / distance;
+
+	// The bounds are seen within an angle of asin(radius / distance) of their center
+	float sinBound = node.radius / distance;
+	float cosBound = sqrtf(1 - sinBound * sinBound);
+
+	if (cosTheta >= cosBound)
+	{
+		return node.power;
+	}
+
+	// Cosine of the angle between the normal and the closest direction into the bounds
+	float sinTheta = sqrtf(FloatMax(0.0f, 1 - cosTheta * cosTheta));
+	float cosClosest = cosTheta * cosBound + sinTheta * sinBound;
+
+	return cosClosest > 0 ? node.power * cosClosest : 0;
+}
+
+int LightTree::Sample(const Vec3f &phit, const Vec3f &nhit, float u, float &pdf) const
+{
+	pdf = 1;
+
+	if (nodeCount == 0 || Importance(nodes[0], phit, nhit) <= 0)
+	{
+		return -1;
+	}
+
+	int nodeIndex = 0;
+
+	while (nodes[nodeIndex].left >= 0)
+	{
+		int left = nodes[nodeIndex].left;
+		float leftImportance = Importance(nodes[left], phit, nhit);
+		float rightImportance = Importance(nodes[left + 1], phit, nhit);
+		float total = leftImportance + rightImportance;
+
+		if (total <= 0)
+		{
+			return -1;
+		}
+
+		// Reuse the random number for the next level by rescaling it to [0, 1)
+		float leftProbability = leftImportance / total;
+
+		if (u < leftProbability)
+		{
+			u = u / leftProbability;
+			pdf *= leftProbability;
+			nodeIndex = left;
+		}
+		else
+		{
+			u = FloatMin((u - leftProbability) / (1 - leftProbability), 0.99999994f);
+			pdf *= 1 - leftProbability;
+			nodeIndex = left + 1;
+		}
+	}
+
+	return (int)nodes[nodeIndex].light;
+}
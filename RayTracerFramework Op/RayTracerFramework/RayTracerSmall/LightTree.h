@@ -0,0 +1,64 @@
+#pragma once
+
+#include "FrameArena.h"
+#include "Structures.h"
+
+struct SphereGeometry;
+struct SphereMaterial;
+
+// Node of a light tree. The children of an interior node are adjacent, and every
+// leaf holds a single light.
+struct LightTreeNode
+{
+	// Bounding sphere of the light centers below the node
+	Vec3f center;
+	float radius;
+
+	// Summed emission of the lights below the node
+	float power;
+
+	int left; // first child of an interior node, -1 for a leaf
+	unsigned light; // scene index of a leaf's light
+};
+
+// Binary tree over the emitters of a scene snapshot, split at the median of the
+// widest axis of their centers. A diffuse hit picks a light by walking down from
+// the root, choosing each child in proportion to its power times the largest
+// N.L any light inside it can have, so lights behind the surface are never picked
+// and bright lights the surface faces are picked most. Nodes live in the arena of
+// the snapshot and are rebuilt every frame.
+class LightTree
+{
+public:
+	LightTree();
+
+	// Build the tree over the given lights in an arena reset for GetFrameBytes
+	void Build(const SphereGeometry* geometry, const SphereMaterial* materials, const unsigned* lights, unsigned lightCount, FrameArena &arena);
+
+	bool IsBuilt() const { return nodeCount > 0; }
+
+	// Scene index of a light picked for a surface point by the random number u in
+	// [0, 1), and the probability it was picked with. -1 if the walk reaches a branch
+	// where no light can reach the point, which counts as a sample of no light.
+	int Sample(const Vec3f &phit, const Vec3f &nhit, float u, float &pdf) const;
+
+	// Arena bytes a tree over the given number of lights needs, build scratch included
+	static size_t GetFrameBytes(size_t lightCount);
+
+private:
+	LightTree(const LightTree&);
+	LightTree& operator=(const LightTree&);
+
+	void BuildNode(int nodeIndex, unsigned first, unsigned count);
+
+	// Power of a node scaled by an upper bound on N.L over its bounding sphere
+	float Importance(const LightTreeNode &node, const Vec3f &phit, const Vec3f &nhit) const;
+
+	LightTreeNode* nodes;
+	int nodeCount;
+
+	// Build scratch
+	const SphereGeometry* geometry;
+	const SphereMaterial* materials;
+	unsigned* lightIndices;
+};
@@ -0,0 +1,271 @@
+#include "OrbitHierarchy.h"
+
+#include <string.h>
+#include <unordered_map>
+
+#include "SceneSnapshot.h"
+
+// Does the ray reach the bounding sphere before tmax. Unlike a surface hit a ray
+// starting inside the bounds always reaches it.
+static bool ReachesBounds(const OrbitSubsystem &subsystem, const Vec3f &rayorig, const Vec3f &raydir, float tmax)
+{
+	Vec3f l = subsystem.center - rayorig;
+	float l2 = l.dot(l);
+	if (l2 <= subsystem.radius2) return true;
+	float tca = l.dot(raydir);
+	if (tca < 0) return false;
+	float d2 = l2 - tca * tca;
+	if (d2 > subsystem.radius2) return false;
+	float thc2 = subsystem.radius2 - d2;
+
+	return tca <= tmax || (tca - tmax) * (tca - tmax) < thc2;
+}
+
+OrbitHierarchy::OrbitHierarchy()
+{
+	geometry = nullptr;
+	subsystems = nullptr;
+	subsystemCount = 0;
+	members = nullptr;
+	nearestHits = false;
+}
+
+size_t OrbitHierarchy::GetFrameBytes(size_t sphereCount)
+{
+	// Every sphere is in exactly one subsystem
+	return FrameArena::ArraySize<OrbitSubsystem>(sphereCount) + FrameArena::ArraySize<unsigned>(sphereCount);
+}
+
+void OrbitHierarchy::Allocate(unsigned subsystemTotal, unsigned memberTotal, FrameArena &arena)
+{
+	subsystems = arena.AllocateArray<OrbitSubsystem>(subsystemTotal);
+	members = arena.AllocateArray<unsigned>(memberTotal);
+	subsystemCount = 0;
+}
+
+void OrbitHierarchy::Clear()
+{
+	geometry = nullptr;
+	subsystems = nullptr;
+	subsystemCount = 0;
+	members = nullptr;
+}
+
+int OrbitHierarchy::IntersectNearest(const Vec3f &rayorig, const Vec3f &raydir, float &tnear) const
+{
+	int hitIndex = -1;
+
+	for (unsigned s = 0; s < subsystemCount; s++)
+	{
+		const OrbitSubsystem &subsystem = subsystems[s];
+
+		// A lone sphere is its own bounds
+		if (subsystem.memberCount > 1 && !ReachesBounds(subsystem, rayorig, raydir, tnear))
+		{
+			continue;
+		}
+
+		for (unsigned i = 0; i < subsystem.memberCount; i++)
+		{
+			unsigned sphere = members[subsystem.firstMember + i];
+			float t0, t1;
+
+			if (geometry[sphere].intersect(rayorig, raydir, t0, t1))
+			{
+				if (t0 < 0)
+				{
+					t0 = t1;
+				}
+
+				// Ties go to the lower index, as in the linear scan
+				if (t0 < tnear || (t0 == tnear && (int)sphere < hitIndex))
+				{
+					tnear = t0;
+					hitIndex = sphere;
+				}
+			}
+		}
+	}
+
+	return hitIndex;
+}
+
+int OrbitHierarchy::FindOccluder(const Vec3f &rayorig, const Vec3f &raydir, float tmax, unsigned ignoreIndex) const
+{
+	for (unsigned s = 0; s < subsystemCount; s++)
+	{
+		const OrbitSubsystem &subsystem = subsystems[s];
+
+		if (subsystem.memberCount > 1 && !ReachesBounds(subsystem, rayorig, raydir, tmax))
+		{
+			continue;
+		}
+
+		for (unsigned i = 0; i < subsystem.memberCount; i++)
+		{
+			unsigned sphere = members[subsystem.firstMember + i];
+
+			if (sphere != ignoreIndex && geometry[sphere].occludes(rayorig, raydir, tmax))
+			{
+				return sphere;
+			}
+		}
+	}
+
+	return -1;
+}
+
+OrbitHierarchyBuilder::OrbitHierarchyBuilder(bool enabled, bool nearestHits)
+{
+	this->enabled = enabled;
+	this->nearestHits = nearestHits;
+	grouped = false;
+	builtSphereCount = 0;
+}
+
+// Furthest a sphere or anything orbiting it reaches from its center. Each child
+// stays orbitMagnitude away from its parent, so this holds for every frame.
+static float SubsystemRadius(const SphereObj* sphere, size_t depthLeft)
+{
+	float radius = sphere->radius;
+
+	if (depthLeft == 0)
+	{
+		return radius;
+	}
+
+	for (size_t i = 0; i < sphere->childrenSpheres.size(); i++)
+	{
+		const SphereObj* child = sphere->childrenSpheres[i];
+		float childRadius = child->orbitMagnitude + SubsystemRadius(child, depthLeft - 1);
+
+		if (childRadius > radius)
+		{
+			radius = childRadius;
+		}
+	}
+
+	return radius;
+}
+
+void OrbitHierarchyBuilder::Build(const std::vector<SphereObj*> &spheres)
+{
+	size_t sphereCount = spheres.size();
+
+	std::unordered_map<const SphereObj*, unsigned> sphereIndices;
+
+	for (size_t i = 0; i < sphereCount; i++)
+	{
+		sphereIndices[spheres[i]] = (unsigned)i;
+	}
+
+	anchors.clear();
+	radii2.clear();
+	firstMembers.clear();
+	memberCounts.clear();
+	members.resize(sphereCount);
+
+	// A sphere belongs to the subsystem of its ancestor orbiting a top level sphere,
+	// top level spheres form a subsystem of their own
+	std::vector<unsigned> sphereSubsystems(sphereCount);
+	std::unordered_map<unsigned, unsigned> anchorSubsystems;
+
+	for (size_t i = 0; i < sphereCount; i++)
+	{
+		const SphereObj* anchor = spheres[i];
+
+		// The step limit guards against parent cycles in a malformed scene file
+		for (size_t step = 0; step < sphereCount && anchor->parentSphere != nullptr && anchor->parentSphere->parentSphere != nullptr; step++)
+		{
+			anchor = anchor->parentSphere;
+		}
+
+		std::unordered_map<const SphereObj*, unsigned>::const_iterator found = sphereIndices.find(anchor);
+		unsigned anchorIndex = (unsigned)i;
+
+		if (found != sphereIndices.end())
+		{
+			anchorIndex = found->second;
+		}
+		else
+		{
+			anchor = spheres[i];
+		}
+
+		if (anchorSubsystems.find(anchorIndex) == anchorSubsystems.end())
+		{
+			// Planets of a top level sphere are subsystems of their own, so it only bounds itself
+			float radius = anchor->parentSphere != nullptr ? SubsystemRadius(anchor, sphereCount) : anchor->radius;
+			radius += radius * SPHERE_ROUNDING_PADDING; // keep grazing kernel hits inside
+
+			anchorSubsystems[anchorIndex] = (unsigned)anchors.size();
+			anchors.push_back(anchorIndex);
+			radii2.push_back(radius * radius);
+			memberCounts.push_back(0);
+		}
+
+		sphereSubsystems[i] = anchorSubsystems[anchorIndex];
+		memberCounts[sphereSubsystems[i]]++;
+	}
+
+	// Members of each subsystem are stored together in index order
+	grouped = false;
+	unsigned first = 0;
+
+	for (size_t s = 0; s < anchors.size(); s++)
+	{
+		firstMembers.push_back(first);
+		first += memberCounts[s];
+		grouped = grouped || memberCounts[s] > 1;
+	}
+
+	std::vector<unsigned> filled(anchors.size(), 0);
+
+	for (size_t i = 0; i < sphereCount; i++)
+	{
+		unsigned s = sphereSubsystems[i];
+		members[firstMembers[s] + filled[s]++] = (unsigned)i;
+	}
+
+	builtSphereCount = sphereCount;
+}
+
+void OrbitHierarchyBuilder::Update(OrbitHierarchy &hierarchy, const std::vector<SphereObj*> &spheres, const SphereGeometry* geometry, FrameArena &arena)
+{
+	if (!enabled)
+	{
+		hierarchy.Clear();
+		return;
+	}
+
+	if (builtSphereCount != spheres.size() || anchors.empty())
+	{
+		Build(spheres);
+	}
+
+	// A scene of lone spheres gains nothing over the linear kernels
+	if (!grouped)
+	{
+		hierarchy.Clear();
+		return;
+	}
+
+	unsigned subsystemCount = (unsigned)anchors.size();
+	hierarchy.Allocate(subsystemCount, (unsigned)members.size(), arena);
+
+	// Only the centers move from frame to frame
+	for (unsigned s = 0; s < subsystemCount; s++)
+	{
+		OrbitSubsystem &subsystem = hierarchy.subsystems[s];
+		subsystem.center = geometry[anchors[s]].center;
+		subsystem.radius2 = radii2[s];
+		subsystem.firstMember = firstMembers[s];
+		subsystem.memberCount = memberCounts[s];
+	}
+
+	memcpy(hierarchy.members, members.data(), members.size() * sizeof(unsigned));
+
+	hierarchy.geometry = geometry;
+	hierarchy.subsystemCount = subsystemCount;
+	hierarchy.nearestHits = nearestHits;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+
+#include "FrameArena.h"
+#include "SphereObj.h"
+#include "Structures.h"
+
+struct SphereGeometry;
+
+// Bounding sphere around a planetary system, a sphere orbiting a root sphere
+// together with everything orbiting it
+struct OrbitSubsystem
+{
+	Vec3f center;
+	float radius2;
+	unsigned firstMember;
+	unsigned memberCount;
+};
+
+// Two-level structure following the orbit hierarchy of the scene. Rays test the
+// bounding sphere of each subsystem first and only test its members when they
+// reach it, so a whole planet and its moons are rejected with one test. The
+// subsystems and member lists live in the snapshot's arena.
+class OrbitHierarchy
+{
+public:
+	OrbitHierarchy();
+
+	// Reserve room for the given number of subsystems and members in an arena
+	// reset for GetFrameBytes
+	void Allocate(unsigned subsystemTotal, unsigned memberTotal, FrameArena &arena);
+
+	// Drop the subsystems so queries go back to the linear kernels
+	void Clear();
+
+	bool IsBuilt() const { return subsystemCount > 0; }
+	unsigned GetSubsystemCount() const { return subsystemCount; }
+
+	// Whether nearest hit queries use the subsystems too, or only shadow rays
+	bool ServesNearestHits() const { return nearestHits && subsystemCount > 0; }
+
+	// Index of the nearest sphere the ray hits, or -1. Subsystems whose bounding
+	// sphere the ray only reaches beyond the nearest hit so far are skipped.
+	int IntersectNearest(const Vec3f &rayorig, const Vec3f &raydir, float &tnear) const;
+
+	// Index of any sphere other than ignoreIndex blocking the ray before tmax, or -1
+	int FindOccluder(const Vec3f &rayorig, const Vec3f &raydir, float tmax, unsigned ignoreIndex) const;
+
+	// Arena bytes the subsystems of the given number of spheres can need
+	static size_t GetFrameBytes(size_t sphereCount);
+
+private:
+	friend class OrbitHierarchyBuilder;
+
+	const SphereGeometry* geometry;
+
+	OrbitSubsystem* subsystems;
+	unsigned subsystemCount;
+	unsigned* members;
+
+	bool nearestHits;
+};
+
+// Groups the spheres into subsystems once and gives every frame's snapshot their
+// bounds. Children keep a fixed orbit around their parent in the z = -10 plane, so
+// the radius of a subsystem never changes and each frame only moves its center
+// to its anchor sphere. Only used by the thread capturing snapshots.
+class OrbitHierarchyBuilder
+{
+public:
+	// Shadow rays always test the subsystems, nearest hit queries only when
+	// nearestHits is set
+	OrbitHierarchyBuilder(bool enabled, bool nearestHits);
+
+	// Give a snapshot's hierarchy the subsystems for its spheres, or clear it when
+	// no subsystem holds more than one sphere
+	void Update(OrbitHierarchy &hierarchy, const std::vector<SphereObj*> &spheres, const SphereGeometry* geometry, FrameArena &arena);
+
+	unsigned GetSubsystemCount() const { return (unsigned)anchors.size(); }
+
+private:
+	OrbitHierarchyBuilder(const OrbitHierarchyBuilder&);
+	OrbitHierarchyBuilder& operator=(const OrbitHierarchyBuilder&);
+
+	void Build(const std::vector<SphereObj*> &spheres);
+
+	bool enabled;
+	bool nearestHits;
+	bool grouped;
+	size_t builtSphereCount;
+
+	// Sphere each subsystem is centered on, its padded radius^2 and member range
+	std::vector<unsigned> anchors;
+	std::vector<float> radii2;
+	std::vector<unsigned> firstMembers;
+	std::vector<unsigned> memberCounts;
+	std::vector<unsigned> members;
+};
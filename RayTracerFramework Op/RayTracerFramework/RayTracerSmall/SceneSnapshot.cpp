@@ -0,0 +1,381 @@
+#include "SceneSnapshot.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+SceneSnapshot::SceneSnapshot()
+{
+	geometry = nullptr;
+	materials = nullptr;
+	centerX = nullptr;
+	centerY = nullptr;
+	centerZ = nullptr;
+	radius2 = nullptr;
+	sphereArrays = SphereArrays();
+	sphereCount = 0;
+	staticCapturedCount = 0;
+	staticBvh = nullptr;
+	lights = nullptr;
+	lightCount = 0;
+	lightOccluders = nullptr;
+	lightSlots = nullptr;
+}
+
+SceneSnapshot::~SceneSnapshot()
+{
+}
+
+size_t SceneSnapshot::GetSphereBufferBytes(size_t sphereCount)
+{
+	size_t sphereArrayBytes = FrameArena::ArraySize<float>(PaddedSphereCount(sphereCount)) * 4;
+
+	return FrameArena::ArraySize<SphereGeometry>(sphereCount) + FrameArena::ArraySize<SphereMaterial>(sphereCount) + sphereArrayBytes;
+}
+
+size_t SceneSnapshot::GetSphereBytes(size_t sphereCount)
+{
+	return GetSphereBufferBytes(sphereCount) + SphereBVH::GetFrameBytes(sphereCount) + OrbitHierarchy::GetFrameBytes(sphereCount);
+}
+
+size_t SceneSnapshot::GetLightBytes(size_t sphereCount, size_t lightCount)
+{
+	// Room for every sphere to be a candidate of every light with offsets
+	size_t offsetLights = lightCount < SHADOW_LIGHT_LIMIT ? lightCount : SHADOW_LIGHT_LIMIT;
+	size_t offsetBytes = FrameArena::ArraySize<float>(PaddedSphereCount(sphereCount)) * 4 + FrameArena::ArraySize<unsigned>(sphereCount);
+
+	return FrameArena::ArraySize<unsigned>(lightCount) + FrameArena::ArraySize<int>(sphereCount) + FrameArena::ArraySize<LightOccluders>(offsetLights) + offsetBytes * offsetLights + ShadowCandidates::GetFrameBytes(sphereCount) + LightTree::GetFrameBytes(lightCount);
+}
+
+size_t SceneSnapshot::GetFrameBytes(size_t sphereCount, size_t lightCount)
+{
+	return GetSphereBytes(sphereCount) + GetLightBytes(sphereCount, lightCount);
+}
+
+void SceneSnapshot::Capture(const std::vector<SphereObj*> &spheres, SphereBVHBuilder &bvhBuilder, OrbitHierarchyBuilder &hierarchyBuilder)
+{
+	sphereCount = (unsigned)spheres.size();
+
+	unsigned paddedCount = (unsigned)PaddedSphereCount(sphereCount);
+	bool staticCaptured = staticCapturedCount == sphereCount && sphereCount > 0;
+
+	// A new sphere count gets a new buffer, and every sphere is copied into it
+	if (!staticCaptured)
+	{
+		sphereBuffer.Reset(GetSphereBufferBytes(sphereCount));
+		geometry = sphereBuffer.AllocateArray<SphereGeometry>(sphereCount);
+		materials = sphereBuffer.AllocateArray<SphereMaterial>(sphereCount);
+		centerX = sphereBuffer.AllocateArray<float>(paddedCount);
+		centerY = sphereBuffer.AllocateArray<float>(paddedCount);
+		centerZ = sphereBuffer.AllocateArray<float>(paddedCount);
+		radius2 = sphereBuffer.AllocateArray<float>(paddedCount);
+	}
+
+	for (unsigned i = 0; i < sphereCount; i++)
+	{
+		const SphereObj* sphere = spheres[i];
+
+		if (staticCaptured && sphere->staticSphere)
+		{
+			continue;
+		}
+
+		geometry[i].center = sphere->center;
+		geometry[i].radius2 = sphere->radius2;
+
+		materials[i].surfaceColor = sphere->surfaceColor;
+		materials[i].emissionColor = sphere->emissionColor;
+		materials[i].transparency = sphere->transparency;
+		materials[i].reflection = sphere->reflection;
+
+		centerX[i] = sphere->center.x;
+		centerY[i] = sphere->center.y;
+		centerZ[i] = sphere->center.z;
+		radius2[i] = sphere->radius2;
+	}
+
+	// Padding spheres can never be hit
+	for (unsigned i = sphereCount; i < paddedCount; i++)
+	{
+		centerX[i] = 0;
+		centerY[i] = 0;
+		centerZ[i] = 0;
+		radius2[i] = SPHERE_PADDING_RADIUS2;
+	}
+
+	sphereArrays.centerX = centerX;
+	sphereArrays.centerY = centerY;
+	sphereArrays.centerZ = centerZ;
+	sphereArrays.radius2 = radius2;
+	sphereArrays.paddedCount = paddedCount;
+
+	staticCapturedCount = sphereCount;
+
+	arena.Reset(SphereBVH::GetFrameBytes(sphereCount) + OrbitHierarchy::GetFrameBytes(sphereCount));
+	bvhBuilder.Update(bvh, spheres, geometry, arena);
+	staticBvh = bvhBuilder.GetStaticBVH();
+	hierarchyBuilder.Update(hierarchy, spheres, geometry, arena);
+
+	CaptureLights();
+}
+
+void SceneSnapshot::CaptureLights()
+{
+	lightCount = 0;
+
+	for (unsigned i = 0; i < sphereCount; i++)
+	{
+		if (materials[i].emissionColor.x > 0)
+		{
+			lightCount++;
+		}
+	}
+
+	// Shadow rays in scenes with a BVH walk the BVH instead, see SHADOW_LIGHT_LIMIT
+	unsigned offsetLights = lightCount < SHADOW_LIGHT_LIMIT ? lightCount : SHADOW_LIGHT_LIMIT;
+	offsetLights = UsesBVH() ? 0 : offsetLights;
+
+	lightArena.Reset(GetLightBytes(sphereCount, lightCount));
+	lights = lightArena.AllocateArray<unsigned>(lightCount);
+	lightSlots = lightArena.AllocateArray<int>(sphereCount);
+	lightOccluders = lightArena.AllocateArray<LightOccluders>(offsetLights);
+
+	if (offsetLights > 0)
+	{
+		shadowCandidates.Reset(sphereCount, lightArena);
+	}
+
+	unsigned light = 0, slot = 0;
+
+	for (unsigned i = 0; i < sphereCount; i++)
+	{
+		lightSlots[i] = -1;
+
+		if (materials[i].emissionColor.x <= 0)
+		{
+			continue;
+		}
+
+		lights[light++] = i;
+
+		// Shadow rays toward any further light take the general path
+		if (slot == offsetLights)
+		{
+			continue;
+		}
+
+		unsigned* sphereIndices = lightArena.AllocateArray<unsigned>(sphereCount);
+		unsigned candidateCount = shadowCandidates.Find(geometry, sphereCount, i, sphereIndices);
+
+		unsigned paddedCount = (unsigned)PaddedSphereCount(candidateCount);
+		float* offsetX = lightArena.AllocateArray<float>(paddedCount);
+		float* offsetY = lightArena.AllocateArray<float>(paddedCount);
+		float* offsetZ = lightArena.AllocateArray<float>(paddedCount);
+		float* distance2 = lightArena.AllocateArray<float>(paddedCount);
+
+		const Vec3f &lightCenter = geometry[i].center;
+
+		// Shadow rays toward the light start up to this far from it, and the rounding of
+		// the forward test grows with the length of the ray
+		float reach = 0;
+
+		for (unsigned j = 0; j < sphereCount; j++)
+		{
+			reach = FloatMax(reach, (geometry[j].center - lightCenter).length() + sqrtf(geometry[j].radius2));
+		}
+
+		for (unsigned j = 0; j < candidateCount; j++)
+		{
+			const SphereGeometry &sphere = geometry[sphereIndices[j]];
+
+			offsetX[j] = sphere.center.x - lightCenter.x;
+			offsetY[j] = sphere.center.y - lightCenter.y;
+			offsetZ[j] = sphere.center.z - lightCenter.z;
+
+			// Grown by a share of the longest ray that can reach it, so grazing rays are left
+			// to the forward test
+			float offset2 = offsetX[j] * offsetX[j] + offsetY[j] * offsetY[j] + offsetZ[j] * offsetZ[j];
+			float radius = sqrtf(sphere.radius2) + (sqrtf(offset2) + reach) * SPHERE_ROUNDING_PADDING + SPHERE_ROUNDING_PADDING;
+			distance2[j] = offset2 - radius * radius;
+		}
+
+		// Padding spheres are never reached
+		for (unsigned j = candidateCount; j < paddedCount; j++)
+		{
+			offsetX[j] = 0;
+			offsetY[j] = 0;
+			offsetZ[j] = 0;
+			distance2[j] = -SPHERE_PADDING_RADIUS2;
+		}
+
+		LightOccluders &occluders = lightOccluders[slot];
+		occluders.spheres.offsetX = offsetX;
+		occluders.spheres.offsetY = offsetY;
+		occluders.spheres.offsetZ = offsetZ;
+		occluders.spheres.distance2 = distance2;
+		occluders.spheres.paddedCount = paddedCount;
+		occluders.sphereIndices = sphereIndices;
+		occluders.count = candidateCount;
+		lightSlots[i] = (int)slot++;
+	}
+
+	lightTree.Build(geometry, materials, lights, lightCount, lightArena);
+}
+
+void SceneSnapshot::IntersectNearest(const RayPacket &packet, float* tnear, int* hitIndex) const
+{
+	if (!UsesBVH() && !hierarchy.ServesNearestHits())
+	{
+		::IntersectNearestPacket(sphereArrays, packet, tnear, hitIndex);
+		return;
+	}
+
+	for (unsigned lane = 0; lane < packet.size; lane++)
+	{
+		Vec3f raydir(packet.directionX[lane], packet.directionY[lane], packet.directionZ[lane]);
+		hitIndex[lane] = IntersectNearest(packet.origin, raydir, tnear[lane]);
+	}
+}
+
+// Sphere that last blocked each light on this thread, or -1
+static thread_local std::vector<int> lastOccluders;
+
+bool SceneSnapshot::Occluded(const Vec3f &rayorig, const Vec3f &raydir, float tmax, unsigned lightIndex, unsigned surfaceIndex) const
+{
+	if (lastOccluders.size() < sphereCount)
+	{
+		lastOccluders.resize(sphereCount, -1);
+	}
+
+	// Neighbouring shadow rays are usually blocked by the same sphere
+	int lastOccluder = lastOccluders[lightIndex];
+
+	if (lastOccluder >= 0 && (unsigned)lastOccluder < sphereCount && geometry[lastOccluder].occludes(rayorig, raydir, tmax))
+	{
+		return true;
+	}
+
+	if (!UsesBVH() && lightSlots[lightIndex] >= 0)
+	{
+		const LightOccluders &occluders = lightOccluders[lightSlots[lightIndex]];
+
+		// The kernels skip the surface sphere, which every ray leaving it grazes from
+		// the light's end
+		if (surfaceIndex != lightIndex && geometry[surfaceIndex].occludes(rayorig, raydir, tmax))
+		{
+			lastOccluders[lightIndex] = surfaceIndex;
+			return true;
+		}
+
+		const unsigned* surface = std::lower_bound(occluders.sphereIndices, occluders.sphereIndices + occluders.count, surfaceIndex);
+		unsigned surfaceCandidate = surface != occluders.sphereIndices + occluders.count && *surface == surfaceIndex ? (unsigned)(surface - occluders.sphereIndices) : UINT_MAX;
+
+		// Trace the ray back from the light to its origin against the light's offsets
+		Vec3f fromLight = rayorig - geometry[lightIndex].center;
+		float distance = fromLight.length();
+		fromLight = fromLight * (1 / distance);
+
+		int candidate = FindOccluderFromOrigin(occluders.spheres, fromLight, distance, UINT_MAX, surfaceCandidate);
+
+		// Hits against the grown candidates only count if the forward test agrees,
+		// otherwise the search goes on past the rejected one
+		while (candidate >= 0)
+		{
+			unsigned occluder = occluders.sphereIndices[candidate];
+
+			if (geometry[occluder].occludes(rayorig, raydir, tmax))
+			{
+				lastOccluders[lightIndex] = occluder;
+				return true;
+			}
+
+			unsigned next = candidate + 1;
+
+			while (next < occluders.count && (next == surfaceCandidate || !OccludesFromOrigin(occluders.spheres, next, fromLight, distance)))
+			{
+				next++;
+			}
+
+			candidate = next < occluders.count ? (int)next : -1;
+		}
+
+		return false;
+	}
+
+	if (UsesBVH() || hierarchy.IsBuilt())
+	{
+		int occluder = -1;
+
+		if (UsesBVH())
+		{
+			occluder = staticBvh != nullptr ? staticBvh->FindOccluder(rayorig, raydir, tmax, lightIndex) : -1;
+
+			if (occluder < 0 && bvh.IsBuilt())
+			{
+				occluder = bvh.FindOccluder(rayorig, raydir, tmax, lightIndex);
+			}
+		}
+		else
+		{
+			occluder = hierarchy.FindOccluder(rayorig, raydir, tmax, lightIndex);
+		}
+
+		if (occluder >= 0)
+		{
+			lastOccluders[lightIndex] = occluder;
+			return true;
+		}
+
+		return false;
+	}
+
+	for (unsigned i = 0; i < sphereCount; i++)
+	{
+		if (i == lightIndex || (int)i == lastOccluder)
+		{
+			continue;
+		}
+
+		if (geometry[i].occludes(rayorig, raydir, tmax))
+		{
+			lastOccluders[lightIndex] = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+SceneSnapshotPool::SceneSnapshotPool()
+{
+}
+
+SceneSnapshotPool::~SceneSnapshotPool()
+{
+	for (size_t i = 0; i < allSnapshots.size(); i++)
+	{
+		delete allSnapshots[i];
+	}
+}
+
+SceneSnapshot* SceneSnapshotPool::Acquire()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (freeSnapshots.empty())
+	{
+		allSnapshots.push_back(new SceneSnapshot());
+		return allSnapshots.back();
+	}
+
+	SceneSnapshot* snapshot = freeSnapshots.back();
+	freeSnapshots.pop_back();
+
+	return snapshot;
+}
+
+void SceneSnapshotPool::Release(SceneSnapshot* snapshot)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	freeSnapshots.push_back(snapshot);
+}
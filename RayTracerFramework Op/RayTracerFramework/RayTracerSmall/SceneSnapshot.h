@@ -0,0 +1,204 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#include "FrameArena.h"
+#include "LightTree.h"
+#include "OrbitHierarchy.h"
+#include "ShadowCandidates.h"
+#include "SphereBVH.h"
+#include "SphereKernels.h"
+#include "SphereObj.h"
+#include "Structures.h"
+
+// Hot part of a sphere, the only data the intersection loops read. Packed into
+// 16 bytes so four spheres share a cache line.
+struct SphereGeometry
+{
+	Vec3f center;
+	float radius2;
+
+	// Compute a ray-sphere intersection using the geometric solution
+	bool intersect(const Vec3f &rayorig, const Vec3f &raydir, float &t0, float &t1) const
+	{
+		Vec3f l = center - rayorig;
+		float tca = l.dot(raydir);
+		if (tca < 0) return false;
+		float d2 = l.dot(l) - tca * tca;
+		if (d2 > radius2) return false;
+		float thc = sqrt(radius2 - d2);
+		t0 = tca - thc;
+		t1 = tca + thc;
+
+		return true;
+	}
+
+	// Any-hit test for shadow rays: does the ray enter the sphere before tmax. Only
+	// the near root is needed, and it is compared with tmax without a square root.
+	bool occludes(const Vec3f &rayorig, const Vec3f &raydir, float tmax) const
+	{
+		Vec3f l = center - rayorig;
+		float tca = l.dot(raydir);
+		if (tca < 0) return false;
+		float d2 = l.dot(l) - tca * tca;
+		if (d2 > radius2) return false;
+		float thc2 = radius2 - d2;
+
+		return tca <= tmax || (tca - tmax) * (tca - tmax) < thc2;
+	}
+};
+
+static_assert(sizeof(SphereGeometry) == 16, "SphereGeometry must stay packed into 16 bytes");
+
+// Cold part of a sphere, only read when shading a hit
+struct SphereMaterial
+{
+	Vec3f surfaceColor, emissionColor;
+	float transparency, reflection;
+};
+
+// Lights, in scene order, that get occluder candidates each frame. A list holds up
+// to one entry per sphere, so the cap bounds the memory of a snapshot and the work of
+// capturing it. Shadow rays toward any further light take the general path, as do
+// all shadow rays in a scene with a BVH. With many emitters nearly every sphere is a
+// candidate of every light, and scanning the list is slower than walking the BVH.
+#define SHADOW_LIGHT_LIMIT 64
+
+// Spheres that can shadow anything from one light, as offsets from it the shared
+// origin kernels can scan, in the order of the scene. Each is grown by the rounding
+// margin of SphereKernels.h, so the kernels miss nothing the forward test hits.
+struct LightOccluders
+{
+	OriginSphereArrays spheres;
+	const unsigned* sphereIndices;
+	unsigned count;
+};
+
+// Immutable copy of the scene for a single frame. Sphere geometry and materials
+// are stored as two parallel arrays in a buffer the snapshot keeps across frames,
+// along with a padded structure-of-arrays copy of the geometry for the SIMD kernels. The whole render
+// path reads the scene through a const reference to it. Animation state stays in
+// the SphereObj objects and is never touched while rendering.
+class SceneSnapshot
+{
+public:
+	SceneSnapshot();
+	~SceneSnapshot();
+
+	// Copy the current state of the spheres, reusing the buffers of the last frame.
+	// Static spheres are only copied the first time. Large scenes also get a BVH,
+	// the builder's tree over the static spheres plus one over the moving spheres
+	// refitted from its tree, and scenes with orbiting spheres get the bounds of
+	// their planetary systems. The emitters are listed in a tree for picking
+	// among them, and without a BVH every light gets the offsets from it of the
+	// spheres that can shadow anything from it.
+	void Capture(const std::vector<SphereObj*> &spheres, SphereBVHBuilder &bvhBuilder, OrbitHierarchyBuilder &hierarchyBuilder);
+
+	unsigned GetSphereCount() const { return sphereCount; }
+
+	const SphereGeometry* GetGeometry() const { return geometry; }
+	const SphereGeometry& GetGeometry(unsigned index) const { return geometry[index]; }
+	const SphereMaterial& GetMaterial(unsigned index) const { return materials[index]; }
+
+	const SphereArrays& GetSphereArrays() const { return sphereArrays; }
+
+	const SphereBVH& GetBVH() const { return bvh; }
+	const SphereBVH* GetStaticBVH() const { return staticBvh; }
+	const OrbitHierarchy& GetHierarchy() const { return hierarchy; }
+
+	// Emissive spheres, the lights diffuse surfaces are shaded by, in scene order
+	unsigned GetLightCount() const { return lightCount; }
+	unsigned GetLight(unsigned index) const { return lights[index]; }
+	const LightTree& GetLightTree() const { return lightTree; }
+
+	// Index of the nearest sphere the ray hits, or -1. Walks the BVHs when the scene
+	// has them, then the orbit hierarchy if it serves nearest hits, otherwise scans
+	// every sphere with the selected SIMD kernel.
+	int IntersectNearest(const Vec3f &rayorig, const Vec3f &raydir, float &tnear) const
+	{
+		if (UsesBVH())
+		{
+			// Moving spheres only have to beat the nearest static hit
+			int hitIndex = staticBvh != nullptr ? staticBvh->IntersectNearest(rayorig, raydir, tnear) : -1;
+			return bvh.IsBuilt() ? bvh.IntersectNearest(rayorig, raydir, tnear, hitIndex) : hitIndex;
+		}
+
+		return hierarchy.ServesNearestHits() ? hierarchy.IntersectNearest(rayorig, raydir, tnear) : ::IntersectNearest(sphereArrays, rayorig, raydir, tnear);
+	}
+
+	// Nearest hit of every ray in a packet sharing one origin
+	void IntersectNearest(const RayPacket &packet, float* tnear, int* hitIndex) const;
+
+	// True if any sphere other than the light blocks the ray toward it before tmax.
+	// Without a BVH the light's candidates are scanned from its end and every hit is
+	// confirmed by the forward test, so the answer matches a scan of the whole scene.
+	bool Occluded(const Vec3f &rayorig, const Vec3f &raydir, float tmax, unsigned lightIndex, unsigned surfaceIndex) const;
+
+	// Bytes a snapshot of the given number of spheres and lights holds
+	static size_t GetFrameBytes(size_t sphereCount, size_t lightCount);
+
+private:
+	SceneSnapshot(const SceneSnapshot&);
+	SceneSnapshot& operator=(const SceneSnapshot&);
+
+	bool UsesBVH() const { return bvh.IsBuilt() || staticBvh != nullptr; }
+
+	// List the emitters and the offsets of the occluder candidates of each of
+	// them, and build the light tree over them
+	void CaptureLights();
+
+	static size_t GetSphereBytes(size_t sphereCount);
+	static size_t GetSphereBufferBytes(size_t sphereCount);
+	static size_t GetLightBytes(size_t sphereCount, size_t lightCount);
+
+	// Per-frame data built from the spheres, such as the BVH
+	FrameArena arena;
+
+	// Geometry, materials and their structure-of-arrays copy. The buffer is only
+	// reallocated when the sphere count changes, so static spheres copied by an
+	// earlier capture of this many spheres are still in place.
+	FrameArena sphereBuffer;
+	SphereGeometry* geometry;
+	SphereMaterial* materials;
+	float* centerX;
+	float* centerY;
+	float* centerZ;
+	float* radius2;
+	SphereArrays sphereArrays;
+	unsigned sphereCount;
+
+	// Sphere count the buffer was allocated for, 0 before the first capture
+	unsigned staticCapturedCount;
+
+	SphereBVH bvh;
+	const SphereBVH* staticBvh;
+	OrbitHierarchy hierarchy;
+
+	// Sized by the light count as well as the sphere count
+	FrameArena lightArena;
+	unsigned* lights;
+	unsigned lightCount;
+	LightOccluders* lightOccluders;
+	int* lightSlots;
+	ShadowCandidates shadowCandidates;
+	LightTree lightTree;
+};
+
+// Snapshots reused across frames. The producer captures each frame into a free
+// snapshot, which is released once the frame has been written.
+class SceneSnapshotPool
+{
+public:
+	SceneSnapshotPool();
+	~SceneSnapshotPool();
+
+	SceneSnapshot* Acquire();
+	void Release(SceneSnapshot* snapshot);
+
+private:
+	std::vector<SceneSnapshot*> allSnapshots;
+	std::vector<SceneSnapshot*> freeSnapshots;
+
+	std::mutex mutex;
+};
@@ -0,0 +1,268 @@
+#include "ScreenBins.h"
+
+#include <cmath>
+
+#include "SceneSnapshot.h"
+
+// Extent along one image axis of a sphere fully in front of the camera, from the
+// two planes through the camera tangent to the sphere
+static void ProjectedExtent(float centerAxis, float centerZ, float radius, float &extentMin, float &extentMax)
+{
+	float denominator = centerZ * centerZ - radius * radius;
+	float spread = radius * sqrtf(centerAxis * centerAxis + denominator);
+
+	extentMin = (-centerAxis * centerZ - spread) / denominator;
+	extentMax = (-centerAxis * centerZ + spread) / denominator;
+}
+
+int ScreenBin::IntersectNearest(const Vec3f &rayorig, const Vec3f &raydir, float &tnear) const
+{
+	int candidate = ::IntersectNearest(spheres, rayorig, raydir, tnear);
+
+	return candidate >= 0 ? (int)sphereIndices[candidate] : -1;
+}
+
+void ScreenBin::IntersectNearest(const RayPacket &packet, float* tnear, int* hitIndex) const
+{
+	::IntersectNearestPacket(spheres, packet, tnear, hitIndex);
+
+	// Kernels narrower than a full packet leave the lanes past its size untouched
+	for (unsigned lane = 0; lane < packet.size; lane++)
+	{
+		hitIndex[lane] = hitIndex[lane] >= 0 ? (int)sphereIndices[hitIndex[lane]] : -1;
+	}
+}
+
+ScreenBins::ScreenBins()
+{
+	binsX = 0;
+	binsY = 0;
+	width = 0;
+	height = 0;
+	angle = 0;
+	aspectratio = 0;
+}
+
+void ScreenBin::Rasterize(unsigned x0, unsigned y0, unsigned x1, unsigned y1, const Vec3f* raydirs, float* tnear, int* hitIndex) const
+{
+	int pitch = (int)(x1 - x0);
+	unsigned pixelCount = (x1 - x0) * (y1 - y0);
+
+	for (unsigned i = 0; i < pixelCount; i++)
+	{
+		tnear[i] = INFINITY;
+		hitIndex[i] = -1;
+	}
+
+	// Candidates are in scene order, so a strict depth test leaves ties to the lower index
+	for (unsigned c = 0; c < count; c++)
+	{
+		const ScreenRect &rect = sphereRects[c];
+		int rx0 = rect.x0 > (int)x0 ? rect.x0 : (int)x0;
+		int ry0 = rect.y0 > (int)y0 ? rect.y0 : (int)y0;
+		int rx1 = rect.x1 < (int)x1 - 1 ? rect.x1 : (int)x1 - 1;
+		int ry1 = rect.y1 < (int)y1 - 1 ? rect.y1 : (int)y1 - 1;
+
+		float cx = spheres.centerX[c], cy = spheres.centerY[c], cz = spheres.centerZ[c];
+		float radius2 = spheres.radius2[c];
+		float l2 = cx * cx + cy * cy + cz * cz;
+		int sphere = (int)sphereIndices[c];
+
+		// Same arithmetic as the kernels for a ray from the origin
+		for (int y = ry0; y <= ry1; y++)
+		{
+			int row = (y - (int)y0) * pitch - (int)x0;
+
+			for (int x = rx0; x <= rx1; x++)
+			{
+				const Vec3f &raydir = raydirs[row + x];
+
+				float tca = cx * raydir.x + cy * raydir.y + cz * raydir.z;
+				if (tca < 0) continue;
+				float d2 = l2 - tca * tca;
+				if (d2 > radius2) continue;
+				float thc = sqrtf(radius2 - d2);
+
+				float t0 = tca - thc;
+
+				if (t0 < 0)
+				{
+					t0 = tca + thc;
+				}
+
+				if (t0 < tnear[row + x])
+				{
+					tnear[row + x] = t0;
+					hitIndex[row + x] = sphere;
+				}
+			}
+		}
+	}
+}
+
+ScreenRect ScreenBins::ProjectSphere(const Vec3f &center, float radius2) const
+{
+	ScreenRect everyPixel = { 0, 0, (int)width - 1, (int)height - 1 };
+	ScreenRect noPixel = { 0, 0, -1, -1 };
+
+	// Grown by a share of its distance from the camera to keep grazing kernel hits inside
+	float radius = sqrtf(radius2) + center.length() * SPHERE_ROUNDING_PADDING;
+
+	// A sphere around the camera or cut by its plane covers the whole screen
+	if (center.length2() <= radius * radius || (center.z > -radius && center.z < radius))
+	{
+		return everyPixel;
+	}
+
+	// Primary rays never reach a sphere behind the camera
+	if (center.z >= radius)
+	{
+		return noPixel;
+	}
+
+	float uMin, uMax, vMin, vMax;
+	ProjectedExtent(center.x, center.z, radius, uMin, uMax);
+	ProjectedExtent(center.y, center.z, radius, vMin, vMax);
+
+	// Invert primaryRayDirection, keeping a pixel of margin on every side
+	float xMin = ((uMin / (angle * aspectratio)) + 1) * 0.5f * width - 0.5f - 1;
+	float xMax = ((uMax / (angle * aspectratio)) + 1) * 0.5f * width - 0.5f + 1;
+	float yMin = (1 - vMax / angle) * 0.5f * height - 0.5f - 1;
+	float yMax = (1 - vMin / angle) * 0.5f * height - 0.5f + 1;
+
+	if (xMax < 0 || yMax < 0 || xMin > width - 1 || yMin > height - 1)
+	{
+		return noPixel;
+	}
+
+	xMin = xMin > 0 ? xMin : 0;
+	yMin = yMin > 0 ? yMin : 0;
+	xMax = xMax < width - 1 ? xMax : width - 1;
+	yMax = yMax < height - 1 ? yMax : height - 1;
+
+	ScreenRect rect;
+	rect.x0 = (int)floorf(xMin);
+	rect.y0 = (int)floorf(yMin);
+	rect.x1 = (int)ceilf(xMax);
+	rect.y1 = (int)ceilf(yMax);
+
+	return rect;
+}
+
+void ScreenBins::Build(const SceneSnapshot &scene, unsigned width, unsigned height, float angle, float aspectratio)
+{
+	this->width = width;
+	this->height = height;
+	this->angle = angle;
+	this->aspectratio = aspectratio;
+
+	binsX = (width + SCREEN_BIN_SIZE - 1) / SCREEN_BIN_SIZE;
+	binsY = (height + SCREEN_BIN_SIZE - 1) / SCREEN_BIN_SIZE;
+	bins.resize(binsX * binsY);
+
+	unsigned sphereCount = scene.GetSphereCount();
+	sphereRects.resize(sphereCount);
+
+	for (size_t i = 0; i < bins.size(); i++)
+	{
+		bins[i].count = 0;
+	}
+
+	// Count the candidates of every bin
+	for (unsigned i = 0; i < sphereCount; i++)
+	{
+		const SphereGeometry &sphere = scene.GetGeometry(i);
+		sphereRects[i] = ProjectSphere(sphere.center, sphere.radius2);
+		const ScreenRect &rect = sphereRects[i];
+
+		if (rect.x0 > rect.x1)
+		{
+			continue;
+		}
+
+		for (int y = rect.y0 / SCREEN_BIN_SIZE; y <= rect.y1 / SCREEN_BIN_SIZE; y++)
+		{
+			for (int x = rect.x0 / SCREEN_BIN_SIZE; x <= rect.x1 / SCREEN_BIN_SIZE; x++)
+			{
+				bins[y * binsX + x].count++;
+			}
+		}
+	}
+
+	size_t candidateTotal = 0, paddedTotal = 0;
+
+	for (size_t i = 0; i < bins.size(); i++)
+	{
+		candidateTotal += bins[i].count;
+		paddedTotal += PaddedSphereCount(bins[i].count);
+	}
+
+	arena.Reset(FrameArena::ArraySize<float>(paddedTotal) * 4 + FrameArena::ArraySize<unsigned>(candidateTotal) + FrameArena::ArraySize<ScreenRect>(candidateTotal));
+	float* centerX = arena.AllocateArray<float>(paddedTotal);
+	float* centerY = arena.AllocateArray<float>(paddedTotal);
+	float* centerZ = arena.AllocateArray<float>(paddedTotal);
+	float* radius2 = arena.AllocateArray<float>(paddedTotal);
+	unsigned* sphereIndices = arena.AllocateArray<unsigned>(candidateTotal);
+	ScreenRect* candidateRects = arena.AllocateArray<ScreenRect>(candidateTotal);
+
+	// Give every bin its slice of the arrays, each a whole number of SIMD blocks
+	// so every slice stays aligned
+	size_t candidateOffset = 0, paddedOffset = 0;
+
+	for (size_t i = 0; i < bins.size(); i++)
+	{
+		ScreenBin &bin = bins[i];
+		unsigned paddedCount = (unsigned)PaddedSphereCount(bin.count);
+
+		bin.spheres.centerX = centerX + paddedOffset;
+		bin.spheres.centerY = centerY + paddedOffset;
+		bin.spheres.centerZ = centerZ + paddedOffset;
+		bin.spheres.radius2 = radius2 + paddedOffset;
+		bin.spheres.paddedCount = paddedCount;
+		bin.sphereIndices = sphereIndices + candidateOffset;
+		bin.sphereRects = candidateRects + candidateOffset;
+
+		// Padding spheres can never be hit
+		for (unsigned j = bin.count; j < paddedCount; j++)
+		{
+			centerX[paddedOffset + j] = 0;
+			centerY[paddedOffset + j] = 0;
+			centerZ[paddedOffset + j] = 0;
+			radius2[paddedOffset + j] = SPHERE_PADDING_RADIUS2;
+		}
+
+		candidateOffset += bin.count;
+		paddedOffset += paddedCount;
+		bin.count = 0;
+	}
+
+	// Fill the bins in scene order so ties still go to the lower index
+	for (unsigned i = 0; i < sphereCount; i++)
+	{
+		const SphereGeometry &sphere = scene.GetGeometry(i);
+		const ScreenRect &rect = sphereRects[i];
+
+		if (rect.x0 > rect.x1)
+		{
+			continue;
+		}
+
+		for (int y = rect.y0 / SCREEN_BIN_SIZE; y <= rect.y1 / SCREEN_BIN_SIZE; y++)
+		{
+			for (int x = rect.x0 / SCREEN_BIN_SIZE; x <= rect.x1 / SCREEN_BIN_SIZE; x++)
+			{
+				ScreenBin &bin = bins[y * binsX + x];
+				size_t slot = (bin.spheres.centerX - centerX) + bin.count;
+
+				centerX[slot] = sphere.center.x;
+				centerY[slot] = sphere.center.y;
+				centerZ[slot] = sphere.center.z;
+				radius2[slot] = sphere.radius2;
+				sphereIndices[(bin.sphereIndices - sphereIndices) + bin.count] = i;
+				candidateRects[(bin.sphereIndices - sphereIndices) + bin.count] = rect;
+
+				bin.count++;
+			}
+		}
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+
+#include "FrameArena.h"
+#include "SphereKernels.h"
+#include "Structures.h"
+
+class SceneSnapshot;
+
+// Width and height of a screen bin in pixels. A multiple of every ray packet
+// shape and of the wavefront block, so neither ever straddles two bins.
+#define SCREEN_BIN_SIZE 16
+
+// Rectangle of pixels, inclusive on every side and empty when x0 > x1
+struct ScreenRect
+{
+	int x0, y0, x1, y1;
+};
+
+// Spheres whose screen footprint overlaps one bin, as padded arrays the SIMD
+// kernels can scan directly, in the order of the scene
+struct ScreenBin
+{
+	SphereArrays spheres;
+	const unsigned* sphereIndices;
+	const ScreenRect* sphereRects;
+	unsigned count;
+
+	// Index in the scene of the nearest candidate a primary ray hits, or -1
+	int IntersectNearest(const Vec3f &rayorig, const Vec3f &raydir, float &tnear) const;
+
+	// Nearest candidate hit of every primary ray in a packet
+	void IntersectNearest(const RayPacket &packet, float* tnear, int* hitIndex) const;
+
+	// Rasterize the candidates over the pixels x0..x1-1, y0..y1-1 of the bin. Each
+	// candidate only visits the pixels of its own footprint, where the primary ray
+	// of the pixel, given row by row in raydirs, is tested against it and depth
+	// tested. Gives every pixel the same hit IntersectNearest would.
+	void Rasterize(unsigned x0, unsigned y0, unsigned x1, unsigned y1, const Vec3f* raydirs, float* tnear, int* hitIndex) const;
+};
+
+// Per-frame binning of the spheres into screen tiles for the fixed camera at the
+// origin. Each sphere's bounds are projected analytically onto the image plane,
+// so a primary ray only tests the spheres that can cover its pixel and pixels of
+// an empty bin are background without any test.
+class ScreenBins
+{
+public:
+	ScreenBins();
+
+	// Project every sphere of the snapshot and collect the candidates of each bin
+	void Build(const SceneSnapshot &scene, unsigned width, unsigned height, float angle, float aspectratio);
+
+	// Bin holding the given pixel
+	const ScreenBin& GetBin(unsigned x, unsigned y) const { return bins[(y / SCREEN_BIN_SIZE) * binsX + x / SCREEN_BIN_SIZE]; }
+
+private:
+	ScreenBins(const ScreenBins&);
+	ScreenBins& operator=(const ScreenBins&);
+
+	// Pixels a sphere can cover
+	ScreenRect ProjectSphere(const Vec3f &center, float radius2) const;
+
+	// Candidate arrays of the current frame
+	FrameArena arena;
+
+	std::vector<ScreenBin> bins;
+	std::vector<ScreenRect> sphereRects;
+	unsigned binsX, binsY;
+
+	// Camera of the current frame
+	unsigned width, height;
+	float angle, aspectratio;
+};
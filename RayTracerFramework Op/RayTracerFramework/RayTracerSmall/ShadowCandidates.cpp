@@ -0,0 +1,160 @@
+#include "ShadowCandidates.h"
+
+#include <cmath>
+
+#include "SceneSnapshot.h"
+
+#define PI_F 3.14159265f
+
+ShadowCandidates::ShadowCandidates()
+{
+	footprints = nullptr;
+	cells = nullptr;
+}
+
+size_t ShadowCandidates::GetFrameBytes(size_t sphereCount)
+{
+	return FrameArena::ArraySize<Footprint>(sphereCount) + FrameArena::ArraySize<Cell>(SHADOW_GRID_AZIMUTH * SHADOW_GRID_POLAR);
+}
+
+void ShadowCandidates::Reset(unsigned sphereCount, FrameArena &arena)
+{
+	footprints = arena.AllocateArray<Footprint>(sphereCount);
+	cells = arena.AllocateArray<Cell>(SHADOW_GRID_AZIMUTH * SHADOW_GRID_POLAR);
+}
+
+ShadowCandidates::Footprint ShadowCandidates::ProjectSphere(const SphereGeometry &sphere, const Vec3f &lightCenter) const
+{
+	Vec3f offset = sphere.center - lightCenter;
+	float distance = offset.length();
+	// Grown by a share of the distance to keep grazing kernel hits inside, and by as
+	// much again to cover shadow rays leaving 1e-4 off the surface
+	float radius = sqrtf(sphere.radius2) + distance * SPHERE_ROUNDING_PADDING + SPHERE_ROUNDING_PADDING;
+
+	Footprint footprint;
+	footprint.row0 = 0;
+	footprint.row1 = SHADOW_GRID_POLAR - 1;
+	footprint.column0 = 0;
+	footprint.column1 = SHADOW_GRID_AZIMUTH - 1;
+	footprint.nearDistance = distance - radius;
+	footprint.farDistance = distance + radius;
+
+	// A sphere around the light is seen in every direction
+	if (distance <= radius)
+	{
+		footprint.nearDistance = 0;
+		return footprint;
+	}
+
+	float cosPolar = offset.z / distance;
+	cosPolar = cosPolar < -1 ? -1 : (cosPolar > 1 ? 1 : cosPolar);
+
+	float polar = acosf(cosPolar);
+	float azimuth = atan2f(offset.y, offset.x) + PI_F;
+	float halfAngle = asinf(radius / distance);
+
+	const float rowAngle = PI_F / SHADOW_GRID_POLAR;
+	const float columnAngle = 2 * PI_F / SHADOW_GRID_AZIMUTH;
+
+	float polarMin = polar - halfAngle, polarMax = polar + halfAngle;
+	footprint.row0 = polarMin > 0 ? (int)(polarMin / rowAngle) : 0;
+	footprint.row1 = polarMax < PI_F ? (int)(polarMax / rowAngle) : SHADOW_GRID_POLAR - 1;
+	footprint.row1 = footprint.row1 < SHADOW_GRID_POLAR - 1 ? footprint.row1 : SHADOW_GRID_POLAR - 1;
+
+	// A cap over a pole spans every azimuth, any other cap spans asin(sin(halfAngle) / sin(polar)) either side of its center
+	float sinPolar = sinf(polar);
+
+	if (polarMin <= 0 || polarMax >= PI_F || sinf(halfAngle) >= sinPolar)
+	{
+		return footprint;
+	}
+
+	float spread = asinf(sinf(halfAngle) / sinPolar);
+	int column0 = (int)floorf((azimuth - spread) / columnAngle);
+	int column1 = (int)floorf((azimuth + spread) / columnAngle);
+
+	if (column1 - column0 + 1 < SHADOW_GRID_AZIMUTH)
+	{
+		footprint.column0 = column0;
+		footprint.column1 = column1;
+	}
+
+	return footprint;
+}
+
+unsigned ShadowCandidates::Find(const SphereGeometry* geometry, unsigned sphereCount, unsigned lightIndex, unsigned* candidates)
+{
+	const Vec3f &lightCenter = geometry[lightIndex].center;
+
+	for (unsigned i = 0; i < SHADOW_GRID_AZIMUTH * SHADOW_GRID_POLAR; i++)
+	{
+		cells[i].farDistance = -1;
+		cells[i].secondDistance = -1;
+		cells[i].sphere = sphereCount;
+	}
+
+	// Keep the two furthest spheres through every cell, so a sphere can look past itself
+	for (unsigned i = 0; i < sphereCount; i++)
+	{
+		if (i == lightIndex)
+		{
+			continue;
+		}
+
+		const Footprint &footprint = footprints[i] = ProjectSphere(geometry[i], lightCenter);
+
+		for (int row = footprint.row0; row <= footprint.row1; row++)
+		{
+			for (int column = footprint.column0; column <= footprint.column1; column++)
+			{
+				Cell &cell = cells[row * SHADOW_GRID_AZIMUTH + (column + SHADOW_GRID_AZIMUTH) % SHADOW_GRID_AZIMUTH];
+
+				if (footprint.farDistance > cell.farDistance)
+				{
+					cell.secondDistance = cell.farDistance;
+					cell.farDistance = footprint.farDistance;
+					cell.sphere = i;
+				}
+				else if (footprint.farDistance > cell.secondDistance)
+				{
+					cell.secondDistance = footprint.farDistance;
+				}
+			}
+		}
+	}
+
+	unsigned candidateCount = 0;
+
+	for (unsigned i = 0; i < sphereCount; i++)
+	{
+		if (i == lightIndex)
+		{
+			continue;
+		}
+
+		const Footprint &footprint = footprints[i];
+		bool shadows = footprint.nearDistance <= 0;
+
+		for (int row = footprint.row0; row <= footprint.row1 && !shadows; row++)
+		{
+			for (int column = footprint.column0; column <= footprint.column1; column++)
+			{
+				const Cell &cell = cells[row * SHADOW_GRID_AZIMUTH + (column + SHADOW_GRID_AZIMUTH) % SHADOW_GRID_AZIMUTH];
+				float reach = cell.sphere == i ? cell.secondDistance : cell.farDistance;
+
+				if (reach > footprint.nearDistance)
+				{
+					shadows = true;
+					break;
+				}
+			}
+		}
+
+		if (shadows)
+		{
+			candidates[candidateCount++] = i;
+		}
+	}
+
+	return candidateCount;
+}
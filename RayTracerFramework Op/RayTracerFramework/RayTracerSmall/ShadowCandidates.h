@@ -0,0 +1,59 @@
+#pragma once
+
+#include "FrameArena.h"
+#include "Structures.h"
+
+struct SphereGeometry;
+
+// Directions around a light are split into this many cells of azimuth and polar angle
+#define SHADOW_GRID_AZIMUTH 256
+#define SHADOW_GRID_POLAR 64
+
+// Conservative list of the spheres that can shadow any other sphere from one light.
+// Every sphere is seen from the light as a cap of directions spanning a range of
+// distances. A shadow ray from the light to a point on sphere Q only meets sphere P
+// if the caps of P and Q overlap and Q reaches further from the light than P
+// starts, so the caps are rasterized into a latitude-longitude grid of directions
+// around the light, each cell keeping the two furthest spheres covering it. A
+// sphere is a candidate if some other sphere reaches past its near side in any
+// cell it covers. The light itself is never a candidate.
+class ShadowCandidates
+{
+public:
+	ShadowCandidates();
+
+	// Allocate the scratch for the given sphere count from an arena reset for GetFrameBytes
+	void Reset(unsigned sphereCount, FrameArena &arena);
+
+	// Write the candidates of the light to candidates in scene order and return their count
+	unsigned Find(const SphereGeometry* geometry, unsigned sphereCount, unsigned lightIndex, unsigned* candidates);
+
+	// Arena bytes the scratch for the given sphere count needs
+	static size_t GetFrameBytes(size_t sphereCount);
+
+private:
+	ShadowCandidates(const ShadowCandidates&);
+	ShadowCandidates& operator=(const ShadowCandidates&);
+
+	// Cells a sphere covers, as a polar row range and an azimuth column range that
+	// may wrap around. A sphere around the light covers every cell.
+	struct Footprint
+	{
+		int row0, row1;
+		int column0, column1;
+		float nearDistance, farDistance;
+	};
+
+	// Furthest and second furthest sphere reaching through a cell
+	struct Cell
+	{
+		float farDistance;
+		float secondDistance;
+		unsigned sphere;
+	};
+
+	Footprint ProjectSphere(const SphereGeometry &sphere, const Vec3f &lightCenter) const;
+
+	Footprint* footprints;
+	Cell* cells;
+};
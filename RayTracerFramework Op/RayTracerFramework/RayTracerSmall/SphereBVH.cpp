@@ -0,0 +1,551 @@
+#include "SphereBVH.h"
+
+#include <cmath>
+#include <string.h>
+#include <utility>
+
+#include "SceneSnapshot.h"
+
+static float SurfaceArea(const Vec3f &boundsMin, const Vec3f &boundsMax)
+{
+	Vec3f extent = boundsMax - boundsMin;
+	return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+static void GrowBounds(Vec3f &boundsMin, Vec3f &boundsMax, const Vec3f &pointMin, const Vec3f &pointMax)
+{
+	boundsMin.x = FloatMin(boundsMin.x, pointMin.x);
+	boundsMin.y = FloatMin(boundsMin.y, pointMin.y);
+	boundsMin.z = FloatMin(boundsMin.z, pointMin.z);
+	boundsMax.x = FloatMax(boundsMax.x, pointMax.x);
+	boundsMax.y = FloatMax(boundsMax.y, pointMax.y);
+	boundsMax.z = FloatMax(boundsMax.z, pointMax.z);
+}
+
+// Slab test. Returns the distance the ray enters the box, or INFINITY if it misses
+// it or only enters it beyond tmax.
+static float IntersectBox(const BVHNode &node, const Vec3f &rayorig, const Vec3f &invDir, float tmax)
+{
+	float tx0 = (node.boundsMin.x - rayorig.x) * invDir.x, tx1 = (node.boundsMax.x - rayorig.x) * invDir.x;
+	float ty0 = (node.boundsMin.y - rayorig.y) * invDir.y, ty1 = (node.boundsMax.y - rayorig.y) * invDir.y;
+	float tz0 = (node.boundsMin.z - rayorig.z) * invDir.z, tz1 = (node.boundsMax.z - rayorig.z) * invDir.z;
+
+	float tEnter = FloatMax(FloatMax(FloatMin(tx0, tx1), FloatMin(ty0, ty1)), FloatMax(FloatMin(tz0, tz1), 0.0f));
+	float tExit = FloatMin(FloatMin(FloatMax(tx0, tx1), FloatMax(ty0, ty1)), FloatMin(FloatMax(tz0, tz1), tmax));
+
+	return tEnter <= tExit ? tEnter : INFINITY;
+}
+
+SphereBVH::SphereBVH()
+{
+	geometry = nullptr;
+	nodes = nullptr;
+	nodeCount = 0;
+	sphereIndices = nullptr;
+	radii = nullptr;
+	padding = 0;
+	cost = 0;
+}
+
+size_t SphereBVH::GetFrameBytes(size_t sphereCount)
+{
+	// Root, one unused slot to align the child pairs and at most 2n - 2 children
+	size_t maxNodes = 2 * sphereCount + 1;
+
+	return FrameArena::ArraySize<BVHNode>(maxNodes) + FrameArena::ArraySize<unsigned>(sphereCount) + FrameArena::ArraySize<float>(sphereCount);
+}
+
+void SphereBVH::Allocate(unsigned count, FrameArena &arena)
+{
+	nodes = arena.AllocateArray<BVHNode>(2 * count + 1);
+	sphereIndices = arena.AllocateArray<unsigned>(count);
+	radii = arena.AllocateArray<float>(count);
+	nodeCount = 0;
+}
+
+void SphereBVH::Clear()
+{
+	nodeCount = 0;
+}
+
+void SphereBVH::PrepareSpheres(const SphereGeometry* sphereGeometry, unsigned count)
+{
+	geometry = sphereGeometry;
+
+	float sceneRadius = 0;
+
+	// Radii follow the order of the sphere indices
+	for (unsigned i = 0; i < count; i++)
+	{
+		const SphereGeometry &sphere = geometry[sphereIndices[i]];
+		radii[i] = sqrtf(sphere.radius2);
+		sceneRadius = FloatMax(sceneRadius, sphere.center.length() + radii[i]);
+	}
+
+	// Boxes are grown by a share of the scene's radius to keep grazing kernel hits inside
+	padding = sceneRadius * SPHERE_ROUNDING_PADDING;
+}
+
+void SphereBVH::Build(const SphereGeometry* sphereGeometry, const unsigned* indices, unsigned count)
+{
+	memcpy(sphereIndices, indices, sizeof(unsigned) * count);
+
+	PrepareSpheres(sphereGeometry, count);
+
+	if (count == 0)
+	{
+		nodeCount = 0;
+		return;
+	}
+
+	// Children pairs start at index 2 so each pair is 64-byte aligned
+	nodeCount = 2;
+	BuildNode(0, 0, count, 0);
+
+	cost = ComputeCost();
+}
+
+void SphereBVH::Refit(const SphereBVH &source, const SphereGeometry* sphereGeometry, unsigned count)
+{
+	nodeCount = source.nodeCount;
+	memcpy(nodes, source.nodes, sizeof(BVHNode) * nodeCount);
+	memcpy(sphereIndices, source.sphereIndices, sizeof(unsigned) * count);
+
+	PrepareSpheres(sphereGeometry, count);
+
+	// Children always follow their parent, so walking backwards visits them first
+	for (int i = (int)nodeCount - 1; i >= 0; i--)
+	{
+		if (i == 1)
+		{
+			continue;
+		}
+
+		BVHNode &node = nodes[i];
+
+		if (node.sphereCount > 0)
+		{
+			Vec3f centroidMin, centroidMax;
+			ComputeBounds(node.leftFirst, node.sphereCount, node.boundsMin, node.boundsMax, centroidMin, centroidMax);
+		}
+		else
+		{
+			const BVHNode &left = nodes[node.leftFirst];
+			const BVHNode &right = nodes[node.leftFirst + 1];
+
+			node.boundsMin = left.boundsMin;
+			node.boundsMax = left.boundsMax;
+			GrowBounds(node.boundsMin, node.boundsMax, right.boundsMin, right.boundsMax);
+		}
+	}
+
+	cost = ComputeCost();
+}
+
+float SphereBVH::ComputeCost() const
+{
+	float rootArea = SurfaceArea(nodes[0].boundsMin, nodes[0].boundsMax);
+
+	if (rootArea <= 0)
+	{
+		return 0;
+	}
+
+	// Expected traversal steps and sphere tests of a random ray through the root
+	float totalCost = 0;
+
+	for (unsigned i = 0; i < nodeCount; i++)
+	{
+		if (i == 1)
+		{
+			continue;
+		}
+
+		float area = SurfaceArea(nodes[i].boundsMin, nodes[i].boundsMax);
+		totalCost += nodes[i].sphereCount > 0 ? area * nodes[i].sphereCount : area;
+	}
+
+	return totalCost / rootArea;
+}
+
+void SphereBVH::ComputeBounds(unsigned first, unsigned count, Vec3f &boundsMin, Vec3f &boundsMax, Vec3f &centroidMin, Vec3f &centroidMax) const
+{
+	boundsMin = centroidMin = Vec3f(INFINITY);
+	boundsMax = centroidMax = Vec3f(-INFINITY);
+
+	for (unsigned i = first; i < first + count; i++)
+	{
+		const Vec3f &center = geometry[sphereIndices[i]].center;
+		Vec3f extent(radii[i] + padding);
+
+		GrowBounds(boundsMin, boundsMax, center - extent, center + extent);
+		GrowBounds(centroidMin, centroidMax, center, center);
+	}
+}
+
+void SphereBVH::BuildNode(unsigned nodeIndex, unsigned first, unsigned count, int depth)
+{
+	BVHNode &node = nodes[nodeIndex];
+
+	Vec3f centroidMin, centroidMax;
+	ComputeBounds(first, count, node.boundsMin, node.boundsMax, centroidMin, centroidMax);
+
+	node.leftFirst = first;
+	node.sphereCount = count;
+
+	if (count <= 2 || depth >= BVH_MAX_DEPTH)
+	{
+		return;
+	}
+
+	// Find the cheapest split among the bin boundaries of every axis
+	float bestCost = INFINITY;
+	int bestAxis = -1;
+	int bestSplit = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float axisMin = Axis(centroidMin, axis);
+		float axisExtent = Axis(centroidMax, axis) - axisMin;
+
+		if (axisExtent <= 0)
+		{
+			continue;
+		}
+
+		unsigned binCount[BVH_BIN_COUNT] = {};
+		Vec3f binMin[BVH_BIN_COUNT], binMax[BVH_BIN_COUNT];
+
+		for (int bin = 0; bin < BVH_BIN_COUNT; bin++)
+		{
+			binMin[bin] = Vec3f(INFINITY);
+			binMax[bin] = Vec3f(-INFINITY);
+		}
+
+		float binScale = BVH_BIN_COUNT / axisExtent;
+
+		for (unsigned i = first; i < first + count; i++)
+		{
+			const Vec3f &center = geometry[sphereIndices[i]].center;
+			Vec3f extent(radii[i] + padding);
+
+			int bin = (int)((Axis(center, axis) - axisMin) * binScale);
+			bin = bin < BVH_BIN_COUNT - 1 ? bin : BVH_BIN_COUNT - 1;
+
+			binCount[bin]++;
+			GrowBounds(binMin[bin], binMax[bin], center - extent, center + extent);
+		}
+
+		// Sweep from the right to get the area and count right of every boundary
+		float rightArea[BVH_BIN_COUNT];
+		unsigned rightCount[BVH_BIN_COUNT];
+		Vec3f sweepMin(INFINITY), sweepMax(-INFINITY);
+		unsigned sweepCount = 0;
+
+		for (int bin = BVH_BIN_COUNT - 1; bin > 0; bin--)
+		{
+			GrowBounds(sweepMin, sweepMax, binMin[bin], binMax[bin]);
+			sweepCount += binCount[bin];
+			rightArea[bin] = sweepCount > 0 ? SurfaceArea(sweepMin, sweepMax) : 0;
+			rightCount[bin] = sweepCount;
+		}
+
+		sweepMin = Vec3f(INFINITY);
+		sweepMax = Vec3f(-INFINITY);
+		sweepCount = 0;
+
+		for (int split = 1; split < BVH_BIN_COUNT; split++)
+		{
+			GrowBounds(sweepMin, sweepMax, binMin[split - 1], binMax[split - 1]);
+			sweepCount += binCount[split - 1];
+
+			if (sweepCount == 0 || rightCount[split] == 0)
+			{
+				continue;
+			}
+
+			float cost = sweepCount * SurfaceArea(sweepMin, sweepMax) + rightCount[split] * rightArea[split];
+
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = split;
+			}
+		}
+	}
+
+	// Keep small nodes as leaves when no split is cheaper than testing every sphere
+	float leafCost = count * SurfaceArea(node.boundsMin, node.boundsMax);
+
+	if (bestAxis < 0 || (count <= BVH_MAX_LEAF_SIZE && bestCost >= leafCost))
+	{
+		return;
+	}
+
+	float axisMin = Axis(centroidMin, bestAxis);
+	float binScale = BVH_BIN_COUNT / (Axis(centroidMax, bestAxis) - axisMin);
+
+	// Partition the sphere indices around the chosen bin boundary
+	unsigned left = first, right = first + count;
+
+	while (left < right)
+	{
+		int bin = (int)((Axis(geometry[sphereIndices[left]].center, bestAxis) - axisMin) * binScale);
+		bin = bin < BVH_BIN_COUNT - 1 ? bin : BVH_BIN_COUNT - 1;
+
+		if (bin < bestSplit)
+		{
+			left++;
+		}
+		else
+		{
+			right--;
+			std::swap(sphereIndices[left], sphereIndices[right]);
+			std::swap(radii[left], radii[right]);
+		}
+	}
+
+	unsigned leftCount = left - first;
+	unsigned leftChild = nodeCount;
+	nodeCount += 2;
+
+	node.leftFirst = leftChild;
+	node.sphereCount = 0;
+
+	BuildNode(leftChild, first, leftCount, depth + 1);
+	BuildNode(leftChild + 1, left, count - leftCount, depth + 1);
+}
+
+int SphereBVH::IntersectNearest(const Vec3f &rayorig, const Vec3f &raydir, float &tnear, int hitIndex) const
+{
+	Vec3f invDir(1 / raydir.x, 1 / raydir.y, 1 / raydir.z);
+
+	unsigned stack[BVH_STACK_SIZE];
+	float stackDistance[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	if (IntersectBox(nodes[0], rayorig, invDir, tnear) == INFINITY)
+	{
+		return hitIndex;
+	}
+
+	unsigned nodeIndex = 0;
+
+	while (true)
+	{
+		const BVHNode &node = nodes[nodeIndex];
+
+		if (node.sphereCount > 0)
+		{
+			for (int i = 0; i < node.sphereCount; i++)
+			{
+				unsigned sphere = sphereIndices[node.leftFirst + i];
+				float t0, t1;
+
+				if (geometry[sphere].intersect(rayorig, raydir, t0, t1))
+				{
+					if (t0 < 0)
+					{
+						t0 = t1;
+					}
+
+					// Ties go to the lower index, as in the linear scan
+					if (t0 < tnear || (t0 == tnear && (int)sphere < hitIndex))
+					{
+						tnear = t0;
+						hitIndex = sphere;
+					}
+				}
+			}
+		}
+		else
+		{
+			// Visit the nearer child first and come back to the other if it is still in range
+			unsigned nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+			float nearDistance = IntersectBox(nodes[nearChild], rayorig, invDir, tnear);
+			float farDistance = IntersectBox(nodes[farChild], rayorig, invDir, tnear);
+
+			if (farDistance < nearDistance)
+			{
+				std::swap(nearChild, farChild);
+				std::swap(nearDistance, farDistance);
+			}
+
+			if (nearDistance != INFINITY)
+			{
+				if (farDistance != INFINITY)
+				{
+					stack[stackSize] = farChild;
+					stackDistance[stackSize] = farDistance;
+					stackSize++;
+				}
+
+				nodeIndex = nearChild;
+				continue;
+			}
+		}
+
+		// Pop the next node that may still hold a nearer hit
+		bool found = false;
+
+		while (stackSize > 0)
+		{
+			stackSize--;
+
+			if (stackDistance[stackSize] <= tnear)
+			{
+				nodeIndex = stack[stackSize];
+				found = true;
+				break;
+			}
+		}
+
+		if (!found)
+		{
+			return hitIndex;
+		}
+	}
+}
+
+int SphereBVH::FindOccluder(const Vec3f &rayorig, const Vec3f &raydir, float tmax, unsigned ignoreIndex) const
+{
+	Vec3f invDir(1 / raydir.x, 1 / raydir.y, 1 / raydir.z);
+
+	unsigned stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		const BVHNode &node = nodes[stack[--stackSize]];
+
+		if (IntersectBox(node, rayorig, invDir, tmax) == INFINITY)
+		{
+			continue;
+		}
+
+		if (node.sphereCount > 0)
+		{
+			for (int i = 0; i < node.sphereCount; i++)
+			{
+				unsigned sphere = sphereIndices[node.leftFirst + i];
+
+				if (sphere != ignoreIndex && geometry[sphere].occludes(rayorig, raydir, tmax))
+				{
+					return sphere;
+				}
+			}
+		}
+		else
+		{
+			stack[stackSize++] = node.leftFirst + 1;
+			stack[stackSize++] = node.leftFirst;
+		}
+	}
+
+	return -1;
+}
+
+SphereBVHBuilder::SphereBVHBuilder(unsigned bvhMinSpheres, float bvhRebuildThreshold, bool staticBvh)
+{
+	minSpheres = bvhMinSpheres;
+	rebuildThreshold = bvhRebuildThreshold;
+	splitStatic = staticBvh;
+	partitionSphereCount = 0;
+	staticActive = false;
+	topologyBuilt = false;
+	buildCost = 0;
+	rebuildCount = 0;
+	refitCount = 0;
+}
+
+void SphereBVHBuilder::Partition(const std::vector<SphereObj*> &spheres, const SphereGeometry* geometry)
+{
+	unsigned count = (unsigned)spheres.size();
+
+	staticIndices.clear();
+	dynamicIndices.clear();
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		if (splitStatic && spheres[i]->staticSphere)
+		{
+			staticIndices.push_back(i);
+		}
+		else
+		{
+			dynamicIndices.push_back(i);
+		}
+	}
+
+	unsigned staticCount = (unsigned)staticIndices.size();
+
+	// The static tree looks spheres up by their scene index, only the static ones are filled in
+	staticArena.Reset(FrameArena::ArraySize<SphereGeometry>(count) + SphereBVH::GetFrameBytes(staticCount));
+	SphereGeometry* staticGeometry = staticArena.AllocateArray<SphereGeometry>(count);
+
+	for (unsigned i = 0; i < staticCount; i++)
+	{
+		staticGeometry[staticIndices[i]] = geometry[staticIndices[i]];
+	}
+
+	staticTree.Allocate(staticCount, staticArena);
+	staticTree.Build(staticGeometry, staticIndices.data(), staticCount);
+
+	partitionSphereCount = count;
+	topologyBuilt = false;
+}
+
+void SphereBVHBuilder::Update(SphereBVH &bvh, const std::vector<SphereObj*> &spheres, const SphereGeometry* geometry, FrameArena &arena)
+{
+	unsigned count = (unsigned)spheres.size();
+
+	// Tiny scenes are faster to scan linearly than to traverse
+	if (minSpheres == 0 || count < minSpheres)
+	{
+		bvh.Clear();
+		staticActive = false;
+		return;
+	}
+
+	if (partitionSphereCount != count)
+	{
+		Partition(spheres, geometry);
+	}
+
+	staticActive = staticTree.IsBuilt();
+
+	unsigned dynamicCount = (unsigned)dynamicIndices.size();
+
+	if (dynamicCount == 0)
+	{
+		bvh.Clear();
+		return;
+	}
+
+	bvh.Allocate(dynamicCount, arena);
+
+	if (topologyBuilt)
+	{
+		bvh.Refit(topology, geometry, dynamicCount);
+
+		if (bvh.GetCost() <= buildCost * rebuildThreshold)
+		{
+			refitCount++;
+			return;
+		}
+	}
+
+	// First frame, a changed sphere count, or orbits have stretched the refitted
+	// boxes so far that a new tree pays for itself
+	topologyArena.Reset(SphereBVH::GetFrameBytes(dynamicCount));
+	topology.Allocate(dynamicCount, topologyArena);
+	topology.Build(geometry, dynamicIndices.data(), dynamicCount);
+
+	topologyBuilt = true;
+	buildCost = topology.GetCost();
+	rebuildCount++;
+
+	bvh.Refit(topology, geometry, dynamicCount);
+}
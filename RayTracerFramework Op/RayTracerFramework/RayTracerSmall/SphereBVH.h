@@ -0,0 +1,144 @@
+#pragma once
+
+#include <vector>
+
+#include "FrameArena.h"
+#include "SphereObj.h"
+#include "Structures.h"
+
+struct SphereGeometry;
+
+// Most spheres a leaf may hold when splitting it would cost more
+#define BVH_MAX_LEAF_SIZE 4
+
+// Candidate split planes per axis in the SAH build
+#define BVH_BIN_COUNT 16
+
+// Traversal stack size. Nodes deeper than BVH_MAX_DEPTH are kept as leaves so the
+// stack can never overflow.
+#define BVH_STACK_SIZE 64
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 2)
+
+// Flattened bounding volume node. Children are stored as adjacent pairs starting
+// on an even index, so both boxes tested at an interior node share a cache line.
+struct BVHNode
+{
+	Vec3f boundsMin;
+	int leftFirst; // left child of an interior node, first sphere index of a leaf
+	Vec3f boundsMax;
+	int sphereCount; // 0 for interior nodes
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode must stay 32 bytes so two fit in a cache line");
+
+// Bounding volume hierarchy over some of the spheres of a scene snapshot, built
+// with the surface area heuristic. Nodes and sphere indices live in the arena of
+// the snapshot, or of the builder for the static spheres kept for the whole clip.
+class SphereBVH
+{
+public:
+	SphereBVH();
+
+	// Reserve room for a tree over the given number of spheres in an arena reset
+	// for GetFrameBytes
+	void Allocate(unsigned count, FrameArena &arena);
+
+	// Build a new tree over the spheres with the given indices
+	void Build(const SphereGeometry* sphereGeometry, const unsigned* indices, unsigned count);
+
+	// Copy the tree of another frame and refit its bounds bottom-up to these
+	// spheres. Only the bounds change, so the tree is rebuilt once the spheres have
+	// moved far enough to make it expensive to traverse.
+	void Refit(const SphereBVH &source, const SphereGeometry* sphereGeometry, unsigned count);
+
+	// Drop the tree so queries go back to the linear kernels
+	void Clear();
+
+	bool IsBuilt() const { return nodeCount > 0; }
+	unsigned GetNodeCount() const { return nodeCount; }
+
+	// Surface area heuristic cost of the tree relative to its root, the quality
+	// measure used to decide when a refitted tree should be rebuilt
+	float GetCost() const { return cost; }
+
+	// Index of the nearest sphere the ray hits, or hitIndex if none is nearer than
+	// the hit already found at tnear. Children are visited nearest first and boxes
+	// beyond the nearest hit so far are skipped.
+	int IntersectNearest(const Vec3f &rayorig, const Vec3f &raydir, float &tnear, int hitIndex = -1) const;
+
+	// Index of any sphere other than ignoreIndex blocking the ray before tmax, or -1
+	int FindOccluder(const Vec3f &rayorig, const Vec3f &raydir, float tmax, unsigned ignoreIndex) const;
+
+	// Arena bytes a tree over the given number of spheres needs, build scratch included
+	static size_t GetFrameBytes(size_t sphereCount);
+
+private:
+	void PrepareSpheres(const SphereGeometry* sphereGeometry, unsigned count);
+	float ComputeCost() const;
+	void BuildNode(unsigned nodeIndex, unsigned first, unsigned count, int depth);
+	void ComputeBounds(unsigned first, unsigned count, Vec3f &boundsMin, Vec3f &boundsMax, Vec3f &centroidMin, Vec3f &centroidMax) const;
+
+	const SphereGeometry* geometry;
+
+	BVHNode* nodes;
+	unsigned nodeCount;
+	unsigned* sphereIndices;
+
+	// Build scratch, in the order of the sphere indices
+	float* radii;
+	float padding;
+
+	float cost;
+};
+
+// Keeps the BVHs of an animated scene across frames. Static spheres can get a tree
+// of their own, built once over a copy of their geometry and shared by every
+// snapshot of the clip. The other spheres get a tree built once too, and every
+// frame's snapshot gets a copy refitted to their positions, until the refitted
+// cost exceeds the cost at build time by the rebuild threshold. Only used by the
+// thread capturing snapshots, and must outlive every snapshot using its tree.
+class SphereBVHBuilder
+{
+public:
+	SphereBVHBuilder(unsigned bvhMinSpheres, float bvhRebuildThreshold, bool staticBvh);
+
+	// Give a snapshot's BVH the tree for its moving spheres, or clear it for tiny
+	// scenes and scenes where nothing moves
+	void Update(SphereBVH &bvh, const std::vector<SphereObj*> &spheres, const SphereGeometry* geometry, FrameArena &arena);
+
+	// Tree over the static spheres for the last update, or nullptr
+	const SphereBVH* GetStaticBVH() const { return staticActive ? &staticTree : nullptr; }
+
+	unsigned GetMinSpheres() const { return minSpheres; }
+	unsigned GetRebuildCount() const { return rebuildCount; }
+	unsigned GetRefitCount() const { return refitCount; }
+
+private:
+	SphereBVHBuilder(const SphereBVHBuilder&);
+	SphereBVHBuilder& operator=(const SphereBVHBuilder&);
+
+	void Partition(const std::vector<SphereObj*> &spheres, const SphereGeometry* geometry);
+
+	// Spheres split by the importer's classification when the scene was first seen
+	bool splitStatic;
+	unsigned partitionSphereCount;
+	std::vector<unsigned> staticIndices;
+	std::vector<unsigned> dynamicIndices;
+
+	// Static spheres never move, so their geometry is copied once
+	FrameArena staticArena;
+	SphereBVH staticTree;
+	bool staticActive;
+
+	// Tree last built over the moving spheres, whose topology every refit copies
+	FrameArena topologyArena;
+	SphereBVH topology;
+	bool topologyBuilt;
+	float buildCost;
+
+	unsigned minSpheres;
+	float rebuildThreshold;
+
+	unsigned rebuildCount;
+	unsigned refitCount;
+};
@@ -0,0 +1,703 @@
+#include "SphereKernels.h"
+
+#include <cmath>
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define KERNEL_TARGET(isa)
+#else
+#include <cpuid.h>
+// Kernels are built for their instruction set only, and never fuse multiply-adds
+// so every width produces the same results as the scalar loop
+#define KERNEL_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#endif
+
+// AVX-512 intrinsics need Visual Studio 2017 15.3 or a GCC/Clang build
+#if !defined(_MSC_VER) || _MSC_VER >= 1911
+#define SPHERE_KERNEL_HAS_AVX512
+#endif
+
+typedef int (*IntersectNearestFunction)(const SphereArrays &spheres, const Vec3f &rayorig, const Vec3f &raydir, float &tnear);
+typedef void (*IntersectNearestPacketFunction)(const SphereArrays &spheres, const RayPacket &packet, float* tnear, int* hitIndex);
+typedef int (*FindOccluderFromOriginFunction)(const OriginSphereArrays &spheres, const Vec3f &raydir, float tmax, unsigned ignoreIndex, unsigned surfaceIndex);
+
+#pragma region CPU Detection
+
+static void CpuId(int info[4], int leaf, int subleaf)
+{
+#if defined(_MSC_VER)
+	__cpuidex(info, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+// Register state the operating system saves on a context switch
+static unsigned long long ReadXCR0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+SphereKernel DetectSphereKernel()
+{
+	int info[4];
+	CpuId(info, 0, 0);
+	int maxLeaf = info[0];
+
+	CpuId(info, 1, 0);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	if (!osxsave || !avx)
+	{
+		return SPHERE_KERNEL_SSE;
+	}
+
+	unsigned long long xcr0 = ReadXCR0();
+
+	// The OS must save the YMM registers for AVX, and the opmask and ZMM registers for AVX-512
+	if ((xcr0 & 0x6) != 0x6)
+	{
+		return SPHERE_KERNEL_SSE;
+	}
+
+	if (maxLeaf < 7)
+	{
+		return SPHERE_KERNEL_SSE;
+	}
+
+	CpuId(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+	bool avx512f = (info[1] & (1 << 16)) != 0;
+
+#ifdef SPHERE_KERNEL_HAS_AVX512
+	if (avx512f && (xcr0 & 0xE0) == 0xE0)
+	{
+		return SPHERE_KERNEL_AVX512;
+	}
+#endif
+
+	return avx2 ? SPHERE_KERNEL_AVX2 : SPHERE_KERNEL_SSE;
+}
+
+#pragma endregion
+
+#pragma region Kernels
+
+static int IntersectNearestScalar(const SphereArrays &spheres, const Vec3f &rayorig, const Vec3f &raydir, float &tnear)
+{
+	int hitIndex = -1;
+
+	for (unsigned i = 0; i < spheres.paddedCount; i++)
+	{
+		float lx = spheres.centerX[i] - rayorig.x;
+		float ly = spheres.centerY[i] - rayorig.y;
+		float lz = spheres.centerZ[i] - rayorig.z;
+
+		float tca = lx * raydir.x + ly * raydir.y + lz * raydir.z;
+		if (tca < 0) continue;
+		float d2 = (lx * lx + ly * ly + lz * lz) - tca * tca;
+		if (d2 > spheres.radius2[i]) continue;
+		float thc = sqrtf(spheres.radius2[i] - d2);
+
+		float t0 = tca - thc;
+
+		if (t0 < 0)
+		{
+			t0 = tca + thc;
+		}
+
+		if (t0 < tnear)
+		{
+			tnear = t0;
+			hitIndex = i;
+		}
+	}
+
+	return hitIndex;
+}
+
+// Pick the nearest of the per-lane results, preferring the lowest index on ties
+static int ReduceLanes(const float* laneT, const int* laneIndex, int laneCount, float &tnear)
+{
+	int hitIndex = -1;
+
+	for (int lane = 0; lane < laneCount; lane++)
+	{
+		if (laneIndex[lane] < 0)
+		{
+			continue;
+		}
+
+		if (laneT[lane] < tnear || (laneT[lane] == tnear && laneIndex[lane] < hitIndex))
+		{
+			tnear = laneT[lane];
+			hitIndex = laneIndex[lane];
+		}
+	}
+
+	return hitIndex;
+}
+
+static int IntersectNearestSSE(const SphereArrays &spheres, const Vec3f &rayorig, const Vec3f &raydir, float &tnear)
+{
+	const __m128 originX = _mm_set1_ps(rayorig.x), originY = _mm_set1_ps(rayorig.y), originZ = _mm_set1_ps(rayorig.z);
+	const __m128 directionX = _mm_set1_ps(raydir.x), directionY = _mm_set1_ps(raydir.y), directionZ = _mm_set1_ps(raydir.z);
+	const __m128 zero = _mm_setzero_ps();
+
+	__m128 nearestT = _mm_set1_ps(tnear);
+	__m128i nearestIndex = _mm_set1_epi32(-1);
+	__m128i index = _mm_setr_epi32(0, 1, 2, 3);
+	const __m128i step = _mm_set1_epi32(4);
+
+	for (unsigned i = 0; i < spheres.paddedCount; i += 4)
+	{
+		__m128 lx = _mm_sub_ps(_mm_load_ps(spheres.centerX + i), originX);
+		__m128 ly = _mm_sub_ps(_mm_load_ps(spheres.centerY + i), originY);
+		__m128 lz = _mm_sub_ps(_mm_load_ps(spheres.centerZ + i), originZ);
+		__m128 radius2 = _mm_load_ps(spheres.radius2 + i);
+
+		__m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, directionX), _mm_mul_ps(ly, directionY)), _mm_mul_ps(lz, directionZ));
+		__m128 l2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+		__m128 d2 = _mm_sub_ps(l2, _mm_mul_ps(tca, tca));
+		__m128 thc = _mm_sqrt_ps(_mm_sub_ps(radius2, d2));
+
+		// Near root, or the far root when the origin is inside the sphere
+		__m128 t0 = _mm_sub_ps(tca, thc);
+		__m128 t1 = _mm_add_ps(tca, thc);
+		__m128 insideMask = _mm_cmplt_ps(t0, zero);
+		__m128 t = _mm_or_ps(_mm_and_ps(insideMask, t1), _mm_andnot_ps(insideMask, t0));
+
+		__m128 hitMask = _mm_and_ps(_mm_cmpge_ps(tca, zero), _mm_cmple_ps(d2, radius2));
+		hitMask = _mm_and_ps(hitMask, _mm_cmplt_ps(t, nearestT));
+
+		nearestT = _mm_or_ps(_mm_and_ps(hitMask, t), _mm_andnot_ps(hitMask, nearestT));
+		__m128i hitMaskInt = _mm_castps_si128(hitMask);
+		nearestIndex = _mm_or_si128(_mm_and_si128(hitMaskInt, index), _mm_andnot_si128(hitMaskInt, nearestIndex));
+
+		index = _mm_add_epi32(index, step);
+	}
+
+	alignas(16) float laneT[4];
+	alignas(16) int laneIndex[4];
+	_mm_store_ps(laneT, nearestT);
+	_mm_store_si128((__m128i*)laneIndex, nearestIndex);
+
+	return ReduceLanes(laneT, laneIndex, 4, tnear);
+}
+
+KERNEL_TARGET("avx2")
+static int IntersectNearestAVX2(const SphereArrays &spheres, const Vec3f &rayorig, const Vec3f &raydir, float &tnear)
+{
+	const __m256 originX = _mm256_set1_ps(rayorig.x), originY = _mm256_set1_ps(rayorig.y), originZ = _mm256_set1_ps(rayorig.z);
+	const __m256 directionX = _mm256_set1_ps(raydir.x), directionY = _mm256_set1_ps(raydir.y), directionZ = _mm256_set1_ps(raydir.z);
+	const __m256 zero = _mm256_setzero_ps();
+
+	__m256 nearestT = _mm256_set1_ps(tnear);
+	__m256i nearestIndex = _mm256_set1_epi32(-1);
+	__m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i step = _mm256_set1_epi32(8);
+
+	for (unsigned i = 0; i < spheres.paddedCount; i += 8)
+	{
+		__m256 lx = _mm256_sub_ps(_mm256_load_ps(spheres.centerX + i), originX);
+		__m256 ly = _mm256_sub_ps(_mm256_load_ps(spheres.centerY + i), originY);
+		__m256 lz = _mm256_sub_ps(_mm256_load_ps(spheres.centerZ + i), originZ);
+		__m256 radius2 = _mm256_load_ps(spheres.radius2 + i);
+
+		__m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, directionX), _mm256_mul_ps(ly, directionY)), _mm256_mul_ps(lz, directionZ));
+		__m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+		__m256 d2 = _mm256_sub_ps(l2, _mm256_mul_ps(tca, tca));
+		__m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(radius2, d2));
+
+		__m256 t0 = _mm256_sub_ps(tca, thc);
+		__m256 t1 = _mm256_add_ps(tca, thc);
+		__m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+
+		__m256 hitMask = _mm256_and_ps(_mm256_cmp_ps(tca, zero, _CMP_GE_OQ), _mm256_cmp_ps(d2, radius2, _CMP_LE_OQ));
+		hitMask = _mm256_and_ps(hitMask, _mm256_cmp_ps(t, nearestT, _CMP_LT_OQ));
+
+		nearestT = _mm256_blendv_ps(nearestT, t, hitMask);
+		nearestIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(nearestIndex), _mm256_castsi256_ps(index), hitMask));
+
+		index = _mm256_add_epi32(index, step);
+	}
+
+	alignas(32) float laneT[8];
+	alignas(32) int laneIndex[8];
+	_mm256_store_ps(laneT, nearestT);
+	_mm256_store_si256((__m256i*)laneIndex, nearestIndex);
+
+	return ReduceLanes(laneT, laneIndex, 8, tnear);
+}
+
+#ifdef SPHERE_KERNEL_HAS_AVX512
+
+KERNEL_TARGET("avx512f")
+static int IntersectNearestAVX512(const SphereArrays &spheres, const Vec3f &rayorig, const Vec3f &raydir, float &tnear)
+{
+	const __m512 originX = _mm512_set1_ps(rayorig.x), originY = _mm512_set1_ps(rayorig.y), originZ = _mm512_set1_ps(rayorig.z);
+	const __m512 directionX = _mm512_set1_ps(raydir.x), directionY = _mm512_set1_ps(raydir.y), directionZ = _mm512_set1_ps(raydir.z);
+	const __m512 zero = _mm512_setzero_ps();
+
+	__m512 nearestT = _mm512_set1_ps(tnear);
+	__m512i nearestIndex = _mm512_set1_epi32(-1);
+	__m512i index = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	const __m512i step = _mm512_set1_epi32(16);
+
+	for (unsigned i = 0; i < spheres.paddedCount; i += 16)
+	{
+		__m512 lx = _mm512_sub_ps(_mm512_load_ps(spheres.centerX + i), originX);
+		__m512 ly = _mm512_sub_ps(_mm512_load_ps(spheres.centerY + i), originY);
+		__m512 lz = _mm512_sub_ps(_mm512_load_ps(spheres.centerZ + i), originZ);
+		__m512 radius2 = _mm512_load_ps(spheres.radius2 + i);
+
+		__m512 tca = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lx, directionX), _mm512_mul_ps(ly, directionY)), _mm512_mul_ps(lz, directionZ));
+		__m512 l2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lx, lx), _mm512_mul_ps(ly, ly)), _mm512_mul_ps(lz, lz));
+		__m512 d2 = _mm512_sub_ps(l2, _mm512_mul_ps(tca, tca));
+
+		__mmask16 hitMask = _mm512_cmp_ps_mask(tca, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(d2, radius2, _CMP_LE_OQ);
+
+		if (hitMask != 0)
+		{
+			__m512 thc = _mm512_maskz_sqrt_ps(hitMask, _mm512_sub_ps(radius2, d2));
+			__m512 t0 = _mm512_sub_ps(tca, thc);
+			__m512 t1 = _mm512_add_ps(tca, thc);
+			__m512 t = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t0, zero, _CMP_LT_OQ), t0, t1);
+
+			hitMask &= _mm512_cmp_ps_mask(t, nearestT, _CMP_LT_OQ);
+
+			nearestT = _mm512_mask_blend_ps(hitMask, nearestT, t);
+			nearestIndex = _mm512_mask_blend_epi32(hitMask, nearestIndex, index);
+		}
+
+		index = _mm512_add_epi32(index, step);
+	}
+
+	alignas(64) float laneT[16];
+	alignas(64) int laneIndex[16];
+	_mm512_store_ps(laneT, nearestT);
+	_mm512_store_si512(laneIndex, nearestIndex);
+
+	return ReduceLanes(laneT, laneIndex, 16, tnear);
+}
+
+#endif
+
+#pragma endregion
+
+#pragma region Packet Kernels
+
+// The rays of a packet share their origin, so each sphere's offset from it and its
+// squared length are computed once and broadcast to every lane. Spheres the whole
+// packet misses are rejected before the roots are computed.
+
+static void IntersectNearestPacketScalar(const SphereArrays &spheres, const RayPacket &packet, float* tnear, int* hitIndex)
+{
+	for (unsigned lane = 0; lane < packet.size; lane++)
+	{
+		Vec3f raydir(packet.directionX[lane], packet.directionY[lane], packet.directionZ[lane]);
+		hitIndex[lane] = IntersectNearestScalar(spheres, packet.origin, raydir, tnear[lane]);
+	}
+}
+
+static void IntersectNearestPacketSSE(const SphereArrays &spheres, const RayPacket &packet, float* tnear, int* hitIndex)
+{
+	const __m128 directionX = _mm_load_ps(packet.directionX);
+	const __m128 directionY = _mm_load_ps(packet.directionY);
+	const __m128 directionZ = _mm_load_ps(packet.directionZ);
+	const __m128 zero = _mm_setzero_ps();
+
+	__m128 nearestT = _mm_load_ps(tnear);
+	__m128i nearestIndex = _mm_set1_epi32(-1);
+
+	for (unsigned i = 0; i < spheres.paddedCount; i++)
+	{
+		float lx = spheres.centerX[i] - packet.origin.x;
+		float ly = spheres.centerY[i] - packet.origin.y;
+		float lz = spheres.centerZ[i] - packet.origin.z;
+		float l2 = lx * lx + ly * ly + lz * lz;
+		__m128 radius2 = _mm_set1_ps(spheres.radius2[i]);
+
+		__m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(lx), directionX), _mm_mul_ps(_mm_set1_ps(ly), directionY)), _mm_mul_ps(_mm_set1_ps(lz), directionZ));
+		__m128 d2 = _mm_sub_ps(_mm_set1_ps(l2), _mm_mul_ps(tca, tca));
+		__m128 hitMask = _mm_and_ps(_mm_cmpge_ps(tca, zero), _mm_cmple_ps(d2, radius2));
+
+		if (_mm_movemask_ps(hitMask) == 0)
+		{
+			continue;
+		}
+
+		__m128 thc = _mm_sqrt_ps(_mm_sub_ps(radius2, d2));
+		__m128 t0 = _mm_sub_ps(tca, thc);
+		__m128 t1 = _mm_add_ps(tca, thc);
+		__m128 insideMask = _mm_cmplt_ps(t0, zero);
+		__m128 t = _mm_or_ps(_mm_and_ps(insideMask, t1), _mm_andnot_ps(insideMask, t0));
+
+		hitMask = _mm_and_ps(hitMask, _mm_cmplt_ps(t, nearestT));
+
+		nearestT = _mm_or_ps(_mm_and_ps(hitMask, t), _mm_andnot_ps(hitMask, nearestT));
+		__m128i hitMaskInt = _mm_castps_si128(hitMask);
+		nearestIndex = _mm_or_si128(_mm_and_si128(hitMaskInt, _mm_set1_epi32((int)i)), _mm_andnot_si128(hitMaskInt, nearestIndex));
+	}
+
+	_mm_store_ps(tnear, nearestT);
+	_mm_store_si128((__m128i*)hitIndex, nearestIndex);
+}
+
+KERNEL_TARGET("avx2")
+static void IntersectNearestPacketAVX2(const SphereArrays &spheres, const RayPacket &packet, float* tnear, int* hitIndex)
+{
+	const __m256 directionX = _mm256_load_ps(packet.directionX);
+	const __m256 directionY = _mm256_load_ps(packet.directionY);
+	const __m256 directionZ = _mm256_load_ps(packet.directionZ);
+	const __m256 zero = _mm256_setzero_ps();
+
+	__m256 nearestT = _mm256_load_ps(tnear);
+	__m256i nearestIndex = _mm256_set1_epi32(-1);
+
+	for (unsigned i = 0; i < spheres.paddedCount; i++)
+	{
+		float lx = spheres.centerX[i] - packet.origin.x;
+		float ly = spheres.centerY[i] - packet.origin.y;
+		float lz = spheres.centerZ[i] - packet.origin.z;
+		float l2 = lx * lx + ly * ly + lz * lz;
+		__m256 radius2 = _mm256_set1_ps(spheres.radius2[i]);
+
+		__m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(lx), directionX), _mm256_mul_ps(_mm256_set1_ps(ly), directionY)), _mm256_mul_ps(_mm256_set1_ps(lz), directionZ));
+		__m256 d2 = _mm256_sub_ps(_mm256_set1_ps(l2), _mm256_mul_ps(tca, tca));
+		__m256 hitMask = _mm256_and_ps(_mm256_cmp_ps(tca, zero, _CMP_GE_OQ), _mm256_cmp_ps(d2, radius2, _CMP_LE_OQ));
+
+		if (_mm256_movemask_ps(hitMask) == 0)
+		{
+			continue;
+		}
+
+		__m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(radius2, d2));
+		__m256 t0 = _mm256_sub_ps(tca, thc);
+		__m256 t1 = _mm256_add_ps(tca, thc);
+		__m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+
+		hitMask = _mm256_and_ps(hitMask, _mm256_cmp_ps(t, nearestT, _CMP_LT_OQ));
+
+		nearestT = _mm256_blendv_ps(nearestT, t, hitMask);
+		nearestIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(nearestIndex), _mm256_castsi256_ps(_mm256_set1_epi32((int)i)), hitMask));
+	}
+
+	_mm256_store_ps(tnear, nearestT);
+	_mm256_store_si256((__m256i*)hitIndex, nearestIndex);
+}
+
+#ifdef SPHERE_KERNEL_HAS_AVX512
+
+KERNEL_TARGET("avx512f")
+static void IntersectNearestPacketAVX512(const SphereArrays &spheres, const RayPacket &packet, float* tnear, int* hitIndex)
+{
+	const __m512 directionX = _mm512_load_ps(packet.directionX);
+	const __m512 directionY = _mm512_load_ps(packet.directionY);
+	const __m512 directionZ = _mm512_load_ps(packet.directionZ);
+	const __m512 zero = _mm512_setzero_ps();
+
+	__m512 nearestT = _mm512_load_ps(tnear);
+	__m512i nearestIndex = _mm512_set1_epi32(-1);
+
+	for (unsigned i = 0; i < spheres.paddedCount; i++)
+	{
+		float lx = spheres.centerX[i] - packet.origin.x;
+		float ly = spheres.centerY[i] - packet.origin.y;
+		float lz = spheres.centerZ[i] - packet.origin.z;
+		float l2 = lx * lx + ly * ly + lz * lz;
+		__m512 radius2 = _mm512_set1_ps(spheres.radius2[i]);
+
+		__m512 tca = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(lx), directionX), _mm512_mul_ps(_mm512_set1_ps(ly), directionY)), _mm512_mul_ps(_mm512_set1_ps(lz), directionZ));
+		__m512 d2 = _mm512_sub_ps(_mm512_set1_ps(l2), _mm512_mul_ps(tca, tca));
+		__mmask16 hitMask = _mm512_cmp_ps_mask(tca, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(d2, radius2, _CMP_LE_OQ);
+
+		if (hitMask == 0)
+		{
+			continue;
+		}
+
+		__m512 thc = _mm512_maskz_sqrt_ps(hitMask, _mm512_sub_ps(radius2, d2));
+		__m512 t0 = _mm512_sub_ps(tca, thc);
+		__m512 t1 = _mm512_add_ps(tca, thc);
+		__m512 t = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t0, zero, _CMP_LT_OQ), t0, t1);
+
+		hitMask &= _mm512_cmp_ps_mask(t, nearestT, _CMP_LT_OQ);
+
+		nearestT = _mm512_mask_blend_ps(hitMask, nearestT, t);
+		nearestIndex = _mm512_mask_blend_epi32(hitMask, nearestIndex, _mm512_set1_epi32((int)i));
+	}
+
+	_mm512_store_ps(tnear, nearestT);
+	_mm512_store_si512(hitIndex, nearestIndex);
+}
+
+#endif
+
+#pragma endregion
+
+#pragma region Shared Origin Kernels
+
+// With the offset l and k = |l|^2 - r^2 of each sphere from the shared origin, a ray
+// misses when the sphere is behind it or tca^2 < k, and it enters the sphere before
+// tmax when tca - tmax < sqrt(tca^2 - k). Neither test needs a square root.
+
+static int FindOccluderFromOriginScalar(const OriginSphereArrays &spheres, const Vec3f &raydir, float tmax, unsigned ignoreIndex, unsigned surfaceIndex)
+{
+	for (unsigned i = 0; i < spheres.paddedCount; i++)
+	{
+		if (OccludesFromOrigin(spheres, i, raydir, tmax) && i != ignoreIndex && i != surfaceIndex)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// First sphere of a block whose lane bit is set, skipping the two ignored spheres
+static int FirstOccluder(unsigned laneBits, unsigned first, unsigned ignoreIndex, unsigned surfaceIndex)
+{
+	if (ignoreIndex - first < 32)
+	{
+		laneBits &= ~(1u << (ignoreIndex - first));
+	}
+
+	if (surfaceIndex - first < 32)
+	{
+		laneBits &= ~(1u << (surfaceIndex - first));
+	}
+
+	for (unsigned lane = 0; laneBits != 0; lane++, laneBits >>= 1)
+	{
+		if (laneBits & 1)
+		{
+			return first + lane;
+		}
+	}
+
+	return -1;
+}
+
+static int FindOccluderFromOriginSSE(const OriginSphereArrays &spheres, const Vec3f &raydir, float tmax, unsigned ignoreIndex, unsigned surfaceIndex)
+{
+	const __m128 directionX = _mm_set1_ps(raydir.x), directionY = _mm_set1_ps(raydir.y), directionZ = _mm_set1_ps(raydir.z);
+	const __m128 distance = _mm_set1_ps(tmax);
+	const __m128 zero = _mm_setzero_ps();
+
+	for (unsigned i = 0; i < spheres.paddedCount; i += 4)
+	{
+		__m128 k = _mm_load_ps(spheres.distance2 + i);
+		__m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(spheres.offsetX + i), directionX), _mm_mul_ps(_mm_load_ps(spheres.offsetY + i), directionY)), _mm_mul_ps(_mm_load_ps(spheres.offsetZ + i), directionZ));
+		__m128 tca2 = _mm_mul_ps(tca, tca);
+
+		__m128 reachMask = _mm_or_ps(_mm_cmplt_ps(k, zero), _mm_and_ps(_mm_cmpge_ps(tca, zero), _mm_cmpge_ps(tca2, k)));
+
+		if (_mm_movemask_ps(reachMask) == 0)
+		{
+			continue;
+		}
+
+		__m128 beyond = _mm_sub_ps(tca, distance);
+		__m128 enterMask = _mm_or_ps(_mm_cmple_ps(tca, distance), _mm_cmplt_ps(_mm_mul_ps(beyond, beyond), _mm_sub_ps(tca2, k)));
+
+		int occluder = FirstOccluder(_mm_movemask_ps(_mm_and_ps(reachMask, enterMask)), i, ignoreIndex, surfaceIndex);
+
+		if (occluder >= 0)
+		{
+			return occluder;
+		}
+	}
+
+	return -1;
+}
+
+KERNEL_TARGET("avx2")
+static int FindOccluderFromOriginAVX2(const OriginSphereArrays &spheres, const Vec3f &raydir, float tmax, unsigned ignoreIndex, unsigned surfaceIndex)
+{
+	const __m256 directionX = _mm256_set1_ps(raydir.x), directionY = _mm256_set1_ps(raydir.y), directionZ = _mm256_set1_ps(raydir.z);
+	const __m256 distance = _mm256_set1_ps(tmax);
+	const __m256 zero = _mm256_setzero_ps();
+
+	for (unsigned i = 0; i < spheres.paddedCount; i += 8)
+	{
+		__m256 k = _mm256_load_ps(spheres.distance2 + i);
+		__m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(spheres.offsetX + i), directionX), _mm256_mul_ps(_mm256_load_ps(spheres.offsetY + i), directionY)), _mm256_mul_ps(_mm256_load_ps(spheres.offsetZ + i), directionZ));
+		__m256 tca2 = _mm256_mul_ps(tca, tca);
+
+		__m256 reachMask = _mm256_or_ps(_mm256_cmp_ps(k, zero, _CMP_LT_OQ), _mm256_and_ps(_mm256_cmp_ps(tca, zero, _CMP_GE_OQ), _mm256_cmp_ps(tca2, k, _CMP_GE_OQ)));
+
+		if (_mm256_movemask_ps(reachMask) == 0)
+		{
+			continue;
+		}
+
+		__m256 beyond = _mm256_sub_ps(tca, distance);
+		__m256 enterMask = _mm256_or_ps(_mm256_cmp_ps(tca, distance, _CMP_LE_OQ), _mm256_cmp_ps(_mm256_mul_ps(beyond, beyond), _mm256_sub_ps(tca2, k), _CMP_LT_OQ));
+
+		int occluder = FirstOccluder(_mm256_movemask_ps(_mm256_and_ps(reachMask, enterMask)), i, ignoreIndex, surfaceIndex);
+
+		if (occluder >= 0)
+		{
+			return occluder;
+		}
+	}
+
+	return -1;
+}
+
+#ifdef SPHERE_KERNEL_HAS_AVX512
+
+KERNEL_TARGET("avx512f")
+static int FindOccluderFromOriginAVX512(const OriginSphereArrays &spheres, const Vec3f &raydir, float tmax, unsigned ignoreIndex, unsigned surfaceIndex)
+{
+	const __m512 directionX = _mm512_set1_ps(raydir.x), directionY = _mm512_set1_ps(raydir.y), directionZ = _mm512_set1_ps(raydir.z);
+	const __m512 distance = _mm512_set1_ps(tmax);
+	const __m512 zero = _mm512_setzero_ps();
+
+	for (unsigned i = 0; i < spheres.paddedCount; i += 16)
+	{
+		__m512 k = _mm512_load_ps(spheres.distance2 + i);
+		__m512 tca = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_load_ps(spheres.offsetX + i), directionX), _mm512_mul_ps(_mm512_load_ps(spheres.offsetY + i), directionY)), _mm512_mul_ps(_mm512_load_ps(spheres.offsetZ + i), directionZ));
+		__m512 tca2 = _mm512_mul_ps(tca, tca);
+
+		__mmask16 reachMask = _mm512_cmp_ps_mask(k, zero, _CMP_LT_OQ) | (_mm512_cmp_ps_mask(tca, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(tca2, k, _CMP_GE_OQ));
+
+		if (reachMask == 0)
+		{
+			continue;
+		}
+
+		__m512 beyond = _mm512_sub_ps(tca, distance);
+		__mmask16 enterMask = _mm512_cmp_ps_mask(tca, distance, _CMP_LE_OQ) | _mm512_cmp_ps_mask(_mm512_mul_ps(beyond, beyond), _mm512_sub_ps(tca2, k), _CMP_LT_OQ);
+
+		int occluder = FirstOccluder(reachMask & enterMask, i, ignoreIndex, surfaceIndex);
+
+		if (occluder >= 0)
+		{
+			return occluder;
+		}
+	}
+
+	return -1;
+}
+
+#endif
+
+#pragma endregion
+
+#pragma region Kernel Selection
+
+static IntersectNearestFunction intersectNearestKernel = &IntersectNearestSSE;
+static IntersectNearestPacketFunction intersectNearestPacketKernel = &IntersectNearestPacketSSE;
+static FindOccluderFromOriginFunction findOccluderFromOriginKernel = &FindOccluderFromOriginSSE;
+static SphereKernel selectedKernel = SPHERE_KERNEL_SSE;
+
+SphereKernel SelectSphereKernel(SphereKernel requested)
+{
+	SphereKernel supported = DetectSphereKernel();
+	SphereKernel kernel = requested > supported ? supported : requested;
+
+	switch (kernel)
+	{
+	case SPHERE_KERNEL_SCALAR:
+		intersectNearestKernel = &IntersectNearestScalar;
+		intersectNearestPacketKernel = &IntersectNearestPacketScalar;
+		findOccluderFromOriginKernel = &FindOccluderFromOriginScalar;
+		break;
+	case SPHERE_KERNEL_SSE:
+		intersectNearestKernel = &IntersectNearestSSE;
+		intersectNearestPacketKernel = &IntersectNearestPacketSSE;
+		findOccluderFromOriginKernel = &FindOccluderFromOriginSSE;
+		break;
+	case SPHERE_KERNEL_AVX2:
+		intersectNearestKernel = &IntersectNearestAVX2;
+		intersectNearestPacketKernel = &IntersectNearestPacketAVX2;
+		findOccluderFromOriginKernel = &FindOccluderFromOriginAVX2;
+		break;
+#ifdef SPHERE_KERNEL_HAS_AVX512
+	case SPHERE_KERNEL_AVX512:
+		intersectNearestKernel = &IntersectNearestAVX512;
+		intersectNearestPacketKernel = &IntersectNearestPacketAVX512;
+		findOccluderFromOriginKernel = &FindOccluderFromOriginAVX512;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	selectedKernel = kernel;
+
+	return kernel;
+}
+
+SphereKernel ParseSphereKernel(const std::string &kernelName)
+{
+	if (kernelName == "scalar") return SPHERE_KERNEL_SCALAR;
+	if (kernelName == "sse") return SPHERE_KERNEL_SSE;
+	if (kernelName == "avx2") return SPHERE_KERNEL_AVX2;
+
+	// "auto", "avx512" and anything unknown use the widest supported kernel
+	return SPHERE_KERNEL_AVX512;
+}
+
+const char* GetSphereKernelName(SphereKernel kernel)
+{
+	switch (kernel)
+	{
+	case SPHERE_KERNEL_SCALAR: return "scalar";
+	case SPHERE_KERNEL_SSE: return "SSE (4-wide)";
+	case SPHERE_KERNEL_AVX2: return "AVX2 (8-wide)";
+	case SPHERE_KERNEL_AVX512: return "AVX-512 (16-wide)";
+	}
+
+	return "unknown";
+}
+
+int IntersectNearest(const SphereArrays &spheres, const Vec3f &rayorig, const Vec3f &raydir, float &tnear)
+{
+	return intersectNearestKernel(spheres, rayorig, raydir, tnear);
+}
+
+void GetRayPacketShape(unsigned &packetWidth, unsigned &packetHeight)
+{
+	switch (selectedKernel)
+	{
+	case SPHERE_KERNEL_SSE:
+		packetWidth = 2;
+		packetHeight = 2;
+		break;
+	case SPHERE_KERNEL_AVX2:
+		packetWidth = 4;
+		packetHeight = 2;
+		break;
+	case SPHERE_KERNEL_AVX512:
+		packetWidth = 4;
+		packetHeight = 4;
+		break;
+	default:
+		packetWidth = 1;
+		packetHeight = 1;
+		break;
+	}
+}
+
+void IntersectNearestPacket(const SphereArrays &spheres, const RayPacket &packet, float* tnear, int* hitIndex)
+{
+	intersectNearestPacketKernel(spheres, packet, tnear, hitIndex);
+}
+
+int FindOccluderFromOrigin(const OriginSphereArrays &spheres, const Vec3f &raydir, float tmax, unsigned ignoreIndex, unsigned surfaceIndex)
+{
+	return findOccluderFromOriginKernel(spheres, raydir, tmax, ignoreIndex, surfaceIndex);
+}
+
+#pragma endregion
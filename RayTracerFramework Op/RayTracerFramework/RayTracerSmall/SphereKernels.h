@@ -0,0 +1,112 @@
+#pragma once
+
+#include "Structures.h"
+
+// Sphere arrays are padded to a multiple of the widest kernel
+#define SPHERE_SIMD_WIDTH 16
+
+// Sphere count rounded up to a whole number of widest SIMD blocks
+inline size_t PaddedSphereCount(size_t sphereCount)
+{
+	return (sphereCount + SPHERE_SIMD_WIDTH - 1) / SPHERE_SIMD_WIDTH * SPHERE_SIMD_WIDTH;
+}
+
+// Radius^2 of padding spheres, no ray can hit them
+#define SPHERE_PADDING_RADIUS2 -1e30f
+
+// The kernels accept grazing hits a little outside a sphere through rounding in
+// d2. Bounds that cull spheres before the kernels see them are grown by this share
+// of their size, so they never drop one of those hits.
+#define SPHERE_ROUNDING_PADDING 1e-3f
+
+// Structure-of-arrays view of the sphere geometry. Every array is aligned to 64
+// bytes and padded to a multiple of SPHERE_SIMD_WIDTH.
+struct SphereArrays
+{
+	const float* centerX;
+	const float* centerY;
+	const float* centerZ;
+	const float* radius2;
+
+	unsigned paddedCount;
+};
+
+// Spheres as seen from a point many rays leave, such as a light every shadow ray of
+// a frame ends at. Each sphere's center minus the point and |c - p|^2 - r^2 are
+// computed once, so testing a ray from the point is a dot product and a compare.
+// Same alignment and padding as SphereArrays.
+struct OriginSphereArrays
+{
+	const float* offsetX;
+	const float* offsetY;
+	const float* offsetZ;
+	const float* distance2;
+
+	unsigned paddedCount;
+};
+
+// Largest ray packet, one AVX-512 register of rays
+#define RAY_PACKET_SIZE 16
+
+// Bundle of rays sharing an origin, such as neighbouring primary rays. Lanes past
+// size repeat a live ray so every kernel can process the full register width.
+struct RayPacket
+{
+	Vec3f origin;
+
+	alignas(64) float directionX[RAY_PACKET_SIZE];
+	alignas(64) float directionY[RAY_PACKET_SIZE];
+	alignas(64) float directionZ[RAY_PACKET_SIZE];
+
+	unsigned size;
+};
+
+enum SphereKernel
+{
+	SPHERE_KERNEL_SCALAR,
+	SPHERE_KERNEL_SSE,
+	SPHERE_KERNEL_AVX2,
+	SPHERE_KERNEL_AVX512
+};
+
+// Widest kernel the processor and operating system support
+SphereKernel DetectSphereKernel();
+
+// Use the requested kernel for IntersectNearest, or the widest supported one if it
+// is not available. Returns the kernel selected.
+SphereKernel SelectSphereKernel(SphereKernel requested);
+
+SphereKernel ParseSphereKernel(const std::string &kernelName);
+const char* GetSphereKernelName(SphereKernel kernel);
+
+// Test one ray against every sphere and return the index of the nearest hit, or -1
+// on a miss. Matches the scalar closest-hit loop, including taking the far root
+// when the ray starts inside a sphere and preferring the lower index on ties.
+int IntersectNearest(const SphereArrays &spheres, const Vec3f &rayorig, const Vec3f &raydir, float &tnear);
+
+// Packet of pixels the selected kernel traces at once: 2x2 for SSE, 4x2 for AVX2
+// and 4x4 for AVX-512. The scalar kernel has no packets and returns 1x1.
+void GetRayPacketShape(unsigned &packetWidth, unsigned &packetHeight);
+
+// Nearest hit of every ray in the packet. tnear and hitIndex hold RAY_PACKET_SIZE
+// entries aligned to 64 bytes, and tnear is read as each lane's starting distance.
+void IntersectNearestPacket(const SphereArrays &spheres, const RayPacket &packet, float* tnear, int* hitIndex);
+
+// Index of the first sphere a ray leaving the shared point enters before tmax, or
+// -1. A sphere around the point blocks every ray. The sphere at the point and the
+// surface the ray ends on, ignoreIndex and surfaceIndex, are skipped.
+int FindOccluderFromOrigin(const OriginSphereArrays &spheres, const Vec3f &raydir, float tmax, unsigned ignoreIndex, unsigned surfaceIndex);
+
+// Does a ray leaving the shared point enter sphere i before tmax. The same test,
+// to the bit, every FindOccluderFromOrigin kernel makes for each sphere.
+inline bool OccludesFromOrigin(const OriginSphereArrays &spheres, unsigned i, const Vec3f &raydir, float tmax)
+{
+	float tca = spheres.offsetX[i] * raydir.x + spheres.offsetY[i] * raydir.y + spheres.offsetZ[i] * raydir.z;
+	float k = spheres.distance2[i];
+
+	// Only a sphere around the origin is reached by rays leaving away from it
+	if ((tca < 0 || tca * tca < k) && k >= 0) return false;
+	float thc2 = tca * tca - k;
+
+	return tca <= tmax || (tca - tmax) * (tca - tmax) < thc2;
+}
@@ -14,11 +14,13 @@ SphereObj::SphereObj(
 {
 	parentSphereName = "";
 	parentSphere = nullptr;
+	staticSphere = false;
 }
 
 SphereObj::SphereObj()
 {
 	parentSphere = nullptr;
+	staticSphere = false;
 }
 
 SphereObj::~SphereObj()
@@ -25,6 +25,7 @@ public:
 	float startAngle;
 
 	bool rootSphere;
+	bool staticSphere;                      // never moves once the clip has started
 	float orbitMagnitude;
 
 	std::string parentSphereName;
@@ -54,6 +55,10 @@ public:
 	bool GetRootSphere() { return rootSphere; }
 	void SetRootSphere(bool newRootSphere) { rootSphere = newRootSphere; }
 
+	// Get/Set Static Sphere
+	bool GetStaticSphere() { return staticSphere; }
+	void SetStaticSphere(bool newStaticSphere) { staticSphere = newStaticSphere; }
+
 	// Get/Set Position
 	Vec3f GetPosition() { return center; }
 	void  SetPosition(Vec3f position) { center = position; }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cmath>
 #include <iostream>
 #include <vector>
 
@@ -15,6 +16,63 @@ struct ConfigurationSettings
 	std::string frameRateSetting;
 	std::string resolutionSetting;
 	std::string filePath;
+
+	// Split each frame into screen tiles shared across all worker threads
+	bool tileRendering;
+	int tileSize;
+
+	// Worker pool size (0 = one per logical processor) and core pinning
+	int threadCount;
+	bool pinThreads;
+
+	// Frames queued or rendering at once (0 = twice the worker count) and the
+	// memory they may hold in bytes (0 = unlimited)
+	int maxFramesInFlight;
+	size_t frameMemoryBudget;
+
+	// Back pooled framebuffers with large pages when the privilege is held
+	bool largePages;
+
+	// SIMD width of the sphere intersection kernel: auto, scalar, sse, avx2 or avx512
+	std::string intersectionKernel;
+
+	// Trace neighbouring primary rays together in SIMD packets
+	bool rayPackets;
+
+	// Trace rays breadth first in per-depth queues instead of recursing per pixel
+	bool wavefrontTracing;
+
+	// Secondary rays whose throughput falls below the cutoff are culled, or
+	// randomly kept with a boosted weight when Russian roulette is enabled. The
+	// default of 0 traces every ray. Small cutoffs such as 0.0005 are faster but
+	// change a few output bytes.
+	float contributionCutoff;
+	bool russianRoulette;
+
+	// Build a BVH over scenes with at least this many spheres (0 = always scan linearly)
+	int bvhMinSpheres;
+
+	// The BVH is refitted every frame and rebuilt once its cost exceeds the cost
+	// at build time by this factor
+	float bvhRebuildThreshold;
+
+	// Keep the spheres that never move in a BVH of their own for the whole clip
+	bool staticBvh;
+
+	// Bin the spheres into screen tiles so primary rays only test the spheres
+	// that can cover their pixel
+	bool screenBinning;
+
+	// Find the primary hits by rasterizing the spheres of each screen bin instead
+	// of tracing camera rays
+	bool rasterizePrimary;
+
+	// Test the bounds of each planet and its moons before the spheres themselves
+	bool orbitHierarchy;
+
+	// Lights sampled per diffuse hit from a light tree once a scene has more. The
+	// default of 0 visits every light, sampled images are noisy and vary between runs.
+	int lightSamples;
 };
 
 #pragma region Vec3f Class
@@ -55,4 +113,14 @@ public:
 
 typedef Vec3<float> Vec3f;
 
+// Plain compares, which compile to single min/max instructions unlike fminf/fmaxf
+inline float FloatMin(float a, float b) { return a < b ? a : b; }
+inline float FloatMax(float a, float b) { return a > b ? a : b; }
+
+// Component of a vector along axis 0, 1 or 2
+inline float Axis(const Vec3f &v, int axis)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
 #pragma endregion
\ No newline at end of file
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bytes of inline storage available to a task's callable
+#define TASK_STORAGE_SIZE 48
+
+// Move-only callable stored inline, so creating and queueing a task never
+// allocates. Callables larger than TASK_STORAGE_SIZE are rejected at compile time.
+class Task
+{
+public:
+	Task() : invoke(nullptr), relocate(nullptr) {}
+
+	template<typename Function, typename = typename std::enable_if<!std::is_same<typename std::decay<Function>::type, Task>::value>::type>
+	Task(Function &&function)
+	{
+		typedef typename std::decay<Function>::type Callable;
+
+		static_assert(sizeof(Callable) <= TASK_STORAGE_SIZE, "Task callable does not fit in the inline storage");
+		static_assert(alignof(Callable) <= alignof(double), "Task callable is over-aligned");
+
+		new (storage) Callable(std::forward<Function>(function));
+		invoke = &Invoke<Callable>;
+		relocate = &Relocate<Callable>;
+	}
+
+	Task(Task &&other) : invoke(nullptr), relocate(nullptr)
+	{
+		MoveFrom(other);
+	}
+
+	Task& operator=(Task &&other)
+	{
+		if (this != &other)
+		{
+			Reset();
+			MoveFrom(other);
+		}
+
+		return *this;
+	}
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	~Task() { Reset(); }
+
+	void operator()() { invoke(storage); }
+	explicit operator bool() const { return invoke != nullptr; }
+
+	// Destroy the stored callable
+	void Reset()
+	{
+		if (relocate != nullptr)
+		{
+			relocate(nullptr, storage);
+		}
+
+		invoke = nullptr;
+		relocate = nullptr;
+	}
+
+private:
+	template<typename Callable>
+	static void Invoke(void* callable)
+	{
+		(*static_cast<Callable*>(callable))();
+	}
+
+	// Move the callable into destination, if given, and destroy the source
+	template<typename Callable>
+	static void Relocate(void* destination, void* source)
+	{
+		if (destination != nullptr)
+		{
+			new (destination) Callable(std::move(*static_cast<Callable*>(source)));
+		}
+
+		static_cast<Callable*>(source)->~Callable();
+	}
+
+	void MoveFrom(Task &other)
+	{
+		if (other.relocate != nullptr)
+		{
+			other.relocate(storage, other.storage);
+		}
+
+		invoke = other.invoke;
+		relocate = other.relocate;
+		other.invoke = nullptr;
+		other.relocate = nullptr;
+	}
+
+	alignas(double) unsigned char storage[TASK_STORAGE_SIZE];
+
+	void (*invoke)(void*);
+	void (*relocate)(void*, void*);
+};
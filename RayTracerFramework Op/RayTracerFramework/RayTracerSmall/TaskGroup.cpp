@@ -0,0 +1,48 @@
+#include "TaskGroup.h"
+
+TaskGroup::TaskGroup()
+{
+	pendingTasks = 0;
+	cancelled = false;
+}
+
+TaskGroup::~TaskGroup()
+{
+	Wait();
+}
+
+void TaskGroup::Wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (pendingTasks > 0)
+	{
+		finished.wait(lock);
+	}
+}
+
+bool TaskGroup::WaitFor(std::chrono::milliseconds timeout)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	return finished.wait_for(lock, timeout, [this] { return pendingTasks == 0; });
+}
+
+void TaskGroup::TaskAdded(int taskCount)
+{
+	pendingTasks += taskCount;
+}
+
+bool TaskGroup::TaskFinished()
+{
+	// Counted under the lock so a waiter cannot destroy the group before it is notified
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (--pendingTasks == 0)
+	{
+		finished.notify_all();
+		return true;
+	}
+
+	return false;
+}
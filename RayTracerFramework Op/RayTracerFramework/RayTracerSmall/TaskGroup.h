@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+// Tracks a set of tasks added to the ThreadManager so callers can wait for, or
+// cancel, just that work without waiting for the whole pool.
+class TaskGroup
+{
+public:
+	TaskGroup();
+	~TaskGroup();
+
+	// Block until every task in the group has finished or been skipped
+	void Wait();
+
+	// Block for at most the given time, returns true if the group finished
+	bool WaitFor(std::chrono::milliseconds timeout);
+
+	bool IsDone() const { return pendingTasks == 0; }
+
+	// Tasks of the group that have not started yet are skipped
+	void Cancel() { cancelled = true; }
+	bool IsCancelled() const { return cancelled; }
+
+	int GetPendingTasks() const { return pendingTasks; }
+
+private:
+	friend class ThreadManager;
+
+	void TaskAdded(int taskCount = 1);
+
+	// Returns true if it was the group's last task
+	bool TaskFinished();
+
+	std::atomic<int> pendingTasks;
+	std::atomic<bool> cancelled;
+
+	std::mutex mutex;
+	std::condition_variable finished;
+};
+
+// Handle to a single task returned by ThreadManager::AddTask
+typedef std::shared_ptr<TaskGroup> TaskHandle;
@@ -1,65 +1,350 @@
 #include "ThreadManager.h"
 
-ThreadManager::ThreadManager()
+// Worker index of the calling thread, -1 if it is not one of the pool's workers
+static thread_local int currentWorkerIndex = -1;
+static thread_local ThreadManager* currentThreadManager = nullptr;
+
+WorkerQueue::WorkerQueue() : tasks(64), head(0), count(0)
+{
+}
+
+void WorkerQueue::PushFront(QueuedTask &&task)
+{
+	if (count == tasks.size())
+	{
+		Grow();
+	}
+
+	head = (head + tasks.size() - 1) % tasks.size();
+	tasks[head] = std::move(task);
+	count++;
+}
+
+void WorkerQueue::PushBack(QueuedTask &&task)
+{
+	if (count == tasks.size())
+	{
+		Grow();
+	}
+
+	tasks[(head + count) % tasks.size()] = std::move(task);
+	count++;
+}
+
+void WorkerQueue::PopFront(QueuedTask &task)
+{
+	task = std::move(tasks[head]);
+	head = (head + 1) % tasks.size();
+	count--;
+}
+
+void WorkerQueue::PopBack(QueuedTask &task)
+{
+	task = std::move(tasks[(head + count - 1) % tasks.size()]);
+	count--;
+}
+
+void WorkerQueue::Grow()
 {
+	std::vector<QueuedTask> grownTasks(tasks.size() * 2);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		grownTasks[i] = std::move(tasks[(head + i) % tasks.size()]);
+	}
+
+	tasks.swap(grownTasks);
+	head = 0;
+}
+
+ThreadManager::ThreadManager(int threads, bool pinThreads)
+{
+	threadCount = threads > 0 ? threads : DetectThreadCount();
+	pinWorkers = pinThreads;
+
 	closeThreads = false;
+	nextQueue = 0;
+	queuedTasks = 0;
+	activeTasks = 0;
+	tasksQueuedTotal = 0;
 
-	for (int i = 0; i < THREADLIMIT; i++)
+	workerQueues.reset(new WorkerQueue[threadCount]);
+
+	for (int i = 0; i < threadCount; i++)
 	{
-		threadPool[i] = std::thread(&ThreadManager::ThreadMain, this);
+		threadPool.push_back(std::thread(&ThreadManager::ThreadMain, this, i));
 	}
 }
 
 ThreadManager::~ThreadManager()
 {
+	JoinAllThreads();
+}
+
+TaskHandle ThreadManager::AddTask(Task task)
+{
+	TaskHandle handle = std::make_shared<TaskGroup>();
+
+	QueuedTask queuedTask;
+	queuedTask.function = std::move(task);
+	queuedTask.group = handle.get();
+	queuedTask.handle = handle;
+
+	QueueTask(std::move(queuedTask));
 
+	return handle;
 }
 
-void ThreadManager::AddTask(std::function<void()> task)
+void ThreadManager::AddTask(Task task, TaskGroup &group)
 {
-	taskList.push(task);
+	QueuedTask queuedTask;
+	queuedTask.function = std::move(task);
+	queuedTask.group = &group;
+
+	QueueTask(std::move(queuedTask));
 }
 
-void ThreadManager::ThreadMain()
+void ThreadManager::QueueTask(QueuedTask task)
 {
-	while (!closeThreads)
+	task.group->TaskAdded();
+	activeTasks++;
+
+	if (currentThreadManager == this)
+	{
+		// Work spawned by a worker stays on its own queue, where it is picked up next
+		WorkerQueue &queue = workerQueues[currentWorkerIndex];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.PushFront(std::move(task));
+		queuedTasks++;
+	}
+	else
+	{
+		// Work from outside the pool is spread round robin across the workers
+		WorkerQueue &queue = workerQueues[nextQueue++ % threadCount];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.PushBack(std::move(task));
+		queuedTasks++;
+	}
+
+	// Counted under the sleep mutex so a worker that is about to park sees it
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		tasksQueuedTotal++;
+	}
+
+	taskAvailable.notify_one();
+}
+
+void ThreadManager::QueueTaskRange(unsigned begin, unsigned end, TaskGroup &group, MakeTaskFunction makeTask, const void* function)
+{
+	if (end <= begin)
+	{
+		return;
+	}
+
+	unsigned taskCount = end - begin;
+	group.TaskAdded(taskCount);
+	activeTasks += taskCount;
+
+	// A worker keeps the range on its own queue for idle workers to steal, otherwise
+	// it is split into one contiguous block per worker
+	bool fromWorker = currentThreadManager == this;
+	int queueCount = fromWorker ? 1 : threadCount;
+	unsigned blockSize = (taskCount + queueCount - 1) / queueCount;
+	unsigned index = begin;
+
+	while (index < end)
 	{
-		if (mutex.try_lock())
+		WorkerQueue &queue = fromWorker ? workerQueues[currentWorkerIndex] : workerQueues[nextQueue++ % threadCount];
+		unsigned blockEnd = (end - index > blockSize) ? index + blockSize : end;
+
+		std::lock_guard<std::mutex> lock(queue.mutex);
+
+		for (; index < blockEnd; index++)
 		{
-			if (taskList.size() > 0)
-			{
-				if (taskList.front())
-				{
-					std::function<void()> taskFunction = taskList.front();
-					taskList.pop();
-					mutex.unlock();
-
-					taskFunction();
-				}
-			}
-			else
-			{
-				mutex.unlock();
-			}
+			QueuedTask queuedTask;
+			queuedTask.function = makeTask(function, index);
+			queuedTask.group = &group;
+
+			queue.PushBack(std::move(queuedTask));
+			queuedTasks++;
 		}
 	}
+
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		tasksQueuedTotal += taskCount;
+	}
+
+	taskAvailable.notify_all();
 }
 
-void ThreadManager::JoinAllThreads()
+void ThreadManager::RunTask(QueuedTask &task)
+{
+	if (!task.group->IsCancelled() && task.function)
+	{
+		task.function();
+	}
+
+	// The group may be destroyed by its waiter as soon as it is marked finished
+	bool groupFinished = task.group->TaskFinished();
+	task = QueuedTask();
+
+	// Wake workers parked in Wait on the group
+	if (groupFinished)
+	{
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+
+		taskAvailable.notify_all();
+	}
+
+	if (--activeTasks == 0)
+	{
+		std::lock_guard<std::mutex> lock(idleMutex);
+		allTasksFinished.notify_all();
+	}
+}
+
+void ThreadManager::Wait(TaskGroup &group)
+{
+	if (currentThreadManager != this)
+	{
+		group.Wait();
+		return;
+	}
+
+	// A waiting worker helps with queued work so nested waits cannot starve the pool
+	QueuedTask task;
+
+	while (!group.IsDone())
+	{
+		unsigned seenTasks = tasksQueuedTotal;
+
+		if (PopTask(currentWorkerIndex, task) || StealTask(currentWorkerIndex, task))
+		{
+			RunTask(task);
+		}
+		else
+		{
+			WaitForTask(seenTasks, &group);
+		}
+	}
+}
+
+void ThreadManager::WaitForAll()
+{
+	std::unique_lock<std::mutex> lock(idleMutex);
+
+	while (activeTasks > 0)
+	{
+		allTasksFinished.wait(lock);
+	}
+}
+
+bool ThreadManager::PopTask(int workerIndex, QueuedTask &task)
+{
+	WorkerQueue &queue = workerQueues[workerIndex];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+
+	if (queue.Empty())
+	{
+		return false;
+	}
+
+	queue.PopFront(task);
+	queuedTasks--;
+
+	return true;
+}
+
+bool ThreadManager::StealTask(int workerIndex, QueuedTask &task)
 {
+	for (int i = 1; i < threadCount; i++)
+	{
+		WorkerQueue &victim = workerQueues[(workerIndex + i) % threadCount];
+
+		// Skip victims that are busy rather than queueing up behind them
+		if (!victim.mutex.try_lock())
+		{
+			continue;
+		}
+
+		if (!victim.Empty())
+		{
+			victim.PopBack(task);
+			queuedTasks--;
+			victim.mutex.unlock();
+
+			return true;
+		}
+
+		victim.mutex.unlock();
+	}
+
+	return false;
+}
+
+void ThreadManager::WaitForTask(unsigned seenTasks, const TaskGroup* group)
+{
+	std::unique_lock<std::mutex> lock(sleepMutex);
+
+	while (tasksQueuedTotal == seenTasks && !closeThreads && (group == nullptr || !group->IsDone()))
+	{
+		taskAvailable.wait(lock);
+	}
+}
+
+void ThreadManager::ThreadMain(int workerIndex)
+{
+	currentWorkerIndex = workerIndex;
+	currentThreadManager = this;
+
+	if (pinWorkers)
+	{
+		PinWorker(workerIndex);
+	}
+
+	QueuedTask task;
+	int retries = 0;
+
 	while (!closeThreads)
 	{
-		if (!taskList.empty())
+		unsigned seenTasks = tasksQueuedTotal;
+
+		if (PopTask(workerIndex, task) || StealTask(workerIndex, task))
 		{
-			Sleep(100);
+			RunTask(task);
+			retries = 0;
+		}
+		else if (queuedTasks > 0 && retries < STEAL_RETRY_LIMIT)
+		{
+			// A task is queued behind a victim that is busy, try again shortly
+			retries++;
+			std::this_thread::yield();
 		}
 		else
 		{
-			closeThreads = true;
+			// Tasks still queued behind busy victims are left to their owners
+			WaitForTask(seenTasks);
+			retries = 0;
 		}
 	}
+}
+
+void ThreadManager::JoinAllThreads()
+{
+	WaitForAll();
+
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		closeThreads = true;
+	}
+
+	taskAvailable.notify_all();
 
-	for (int i = 0; i < THREADLIMIT; i++)
+	for (int i = 0; i < threadCount; i++)
 	{
 		if (threadPool[i].joinable())
 		{
@@ -67,3 +352,92 @@ void ThreadManager::JoinAllThreads()
 		}
 	}
 }
+
+int ThreadManager::DetectThreadCount()
+{
+	DWORD processorCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+	if (processorCount == 0)
+	{
+		return THREADLIMIT;
+	}
+
+	return processorCount;
+}
+
+void ThreadManager::PinWorker(int workerIndex)
+{
+	// Walk the processor groups to find the logical processor this worker maps to
+	DWORD processorIndex = workerIndex % DetectThreadCount();
+	WORD groupCount = GetActiveProcessorGroupCount();
+
+	for (WORD group = 0; group < groupCount; group++)
+	{
+		DWORD groupSize = GetActiveProcessorCount(group);
+
+		if (processorIndex < groupSize)
+		{
+			GROUP_AFFINITY affinity = {};
+			affinity.Group = group;
+			affinity.Mask = KAFFINITY(1) << processorIndex;
+
+			SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL);
+			return;
+		}
+
+		processorIndex -= groupSize;
+	}
+}
+
+int ThreadManager::GetCurrentNumaNode()
+{
+	PROCESSOR_NUMBER processor;
+	USHORT node;
+
+	GetCurrentProcessorNumberEx(&processor);
+
+	if (currentThreadManager == nullptr || !GetNumaProcessorNodeEx(&processor, &node))
+	{
+		return -1;
+	}
+
+	return node;
+}
+
+void* ThreadManager::AllocateLocal(size_t bytes, bool largePages)
+{
+	DWORD allocationType = MEM_RESERVE | MEM_COMMIT;
+
+	if (largePages)
+	{
+		// Large page allocations must be a whole number of large pages
+		size_t largePageSize = GetLargePageMinimum();
+
+		if (largePageSize == 0)
+		{
+			return nullptr;
+		}
+
+		bytes = (bytes + largePageSize - 1) / largePageSize * largePageSize;
+		allocationType |= MEM_LARGE_PAGES;
+	}
+
+	int node = GetCurrentNumaNode();
+
+	// Outside the pool the pages are committed but left untouched, so each page is
+	// placed on the node of the worker that writes it first
+	if (node < 0)
+	{
+		return VirtualAlloc(NULL, bytes, allocationType, PAGE_READWRITE);
+	}
+
+	return VirtualAllocExNuma(GetCurrentProcess(), NULL, bytes, allocationType, PAGE_READWRITE, node);
+}
+
+void ThreadManager::FreeLocal(void* memory)
+{
+	if (memory != nullptr)
+	{
+		VirtualFree(memory, 0, MEM_RELEASE);
+	}
+}
\ No newline at end of file
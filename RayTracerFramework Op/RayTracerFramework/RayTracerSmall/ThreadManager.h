@@ -3,28 +3,159 @@
 #include <thread>
 #include <vector>
 #include <condition_variable>
-#include <queue>
+#include <atomic>
+#include <memory>
 
 #include "windows.h"
 
+#include "Task.h"
+#include "TaskGroup.h"
+
+// Worker count used when the processor topology cannot be detected
 #define THREADLIMIT 8
 
+// Times an idle worker retries victims that were busy before it parks
+#define STEAL_RETRY_LIMIT 64
+
+// A queued task and the group waiting on it
+struct QueuedTask
+{
+	Task function;
+	TaskGroup* group = nullptr;
+
+	// Keeps the group of a single task handle alive until the task has run
+	TaskHandle handle;
+};
+
+// Task queue owned by one worker thread, held in a ring buffer that only
+// allocates when it has to grow. The owner takes work from the head, idle
+// workers steal from the tail.
+struct WorkerQueue
+{
+	WorkerQueue();
+
+	bool Empty() const { return count == 0; }
+
+	void PushFront(QueuedTask &&task);
+	void PushBack(QueuedTask &&task);
+	void PopFront(QueuedTask &task);
+	void PopBack(QueuedTask &task);
+
+	std::mutex mutex;
+
+private:
+	void Grow();
+
+	std::vector<QueuedTask> tasks;
+	size_t head;
+	size_t count;
+};
+
+// Task that calls a function with the index it was queued for
+template<typename Function>
+struct IndexedTask
+{
+	Function function;
+	unsigned index;
+
+	void operator()() { function(index); }
+};
+
 class ThreadManager
 {
 public:
-	ThreadManager();
+	// A thread count of 0 creates one worker per logical processor
+	ThreadManager(int threads = 0, bool pinThreads = false);
 	~ThreadManager();
 
-	void AddTask(std::function<void()> task);
+	// Queue a task, the returned handle can be waited on or cancelled. The handle
+	// itself is allocated, use a TaskGroup for fine-grained work.
+	TaskHandle AddTask(Task task);
+
+	// Queue a task as part of a group
+	void AddTask(Task task, TaskGroup &group);
+
+	// Queue one task per index in [begin, end) as part of a group, each calling
+	// function(index). The whole range is queued with one lock per worker queue.
+	template<typename Function>
+	void AddTaskRange(unsigned begin, unsigned end, const Function &function, TaskGroup &group)
+	{
+		QueueTaskRange(begin, end, group, &MakeIndexedTask<Function>, &function);
+	}
 
-	void ThreadMain();
+	// Block until the group has finished. Called from a worker, the worker keeps
+	// running queued tasks while it waits.
+	void Wait(TaskGroup &group);
+
+	// Block until every queued and running task has finished, the workers stay
+	// alive so the pool can be reused. Must not be called from a worker.
+	void WaitForAll();
+
+	void ThreadMain(int workerIndex);
+
+	// Wait for all tasks, then stop and join the workers
 	void JoinAllThreads();
 
+	int GetThreadCount() const { return threadCount; }
+
+	// Number of logical processors across all processor groups
+	static int DetectThreadCount();
+
+	// NUMA node of the processor running the calling worker, -1 outside the pool
+	static int GetCurrentNumaNode();
+
+	// Allocate memory local to the NUMA node of the calling worker, optionally
+	// backed by large pages (returns nullptr if they are unavailable)
+	static void* AllocateLocal(size_t bytes, bool largePages = false);
+	static void FreeLocal(void* memory);
+
 private:
-	std::queue<std::function<void()>> taskList;
-	std::thread threadPool[THREADLIMIT];
-	std::mutex mutex;
+	typedef Task (*MakeTaskFunction)(const void* function, unsigned index);
 
-	bool closeThreads;
-};
+	template<typename Function>
+	static Task MakeIndexedTask(const void* function, unsigned index)
+	{
+		IndexedTask<Function> task = { *static_cast<const Function*>(function), index };
+		return Task(std::move(task));
+	}
+
+	void QueueTask(QueuedTask task);
+	void QueueTaskRange(unsigned begin, unsigned end, TaskGroup &group, MakeTaskFunction makeTask, const void* function);
+
+	// Run a task unless its group was cancelled and mark it finished
+	void RunTask(QueuedTask &task);
 
+	// Take the next task from the worker's own queue
+	bool PopTask(int workerIndex, QueuedTask &task);
+
+	// Take a task from the tail of another worker's queue
+	bool StealTask(int workerIndex, QueuedTask &task);
+
+	// Park the calling worker until a task is queued after the given count of
+	// queued tasks was read, the pool is closed or the given group finishes
+	void WaitForTask(unsigned seenTasks, const TaskGroup* group = nullptr);
+
+	// Restrict the calling worker to a single logical processor
+	void PinWorker(int workerIndex);
+
+	int threadCount;
+	bool pinWorkers;
+
+	std::unique_ptr<WorkerQueue[]> workerQueues;
+	std::vector<std::thread> threadPool;
+
+	std::atomic<unsigned> nextQueue;
+	std::atomic<int> queuedTasks;
+	std::atomic<int> activeTasks;
+
+	// Count of every task ever queued, a worker parks until it moves on
+	std::atomic<unsigned> tasksQueuedTotal;
+
+	std::mutex sleepMutex;
+	std::condition_variable taskAvailable;
+
+	std::mutex idleMutex;
+	std::condition_variable allTasksFinished;
+
+	std::atomic<bool> closeThreads;
+};
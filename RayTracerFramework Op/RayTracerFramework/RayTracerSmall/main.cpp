@@ -39,11 +39,18 @@
 #include "windows.h"
 #include "tinyxml2.h"
 #include <thread>
+#include <functional>
+#include <atomic>
 
 // Include Classes
 #include "SphereObj.h"
 #include "Structures.h"
 #include "ThreadManager.h"
+#include "FrameThrottle.h"
+#include "FramebufferPool.h"
+#include "SceneSnapshot.h"
+#include "ScreenBins.h"
+#include "SphereKernels.h"
 
 #if defined __linux__ || defined __APPLE__
 // "Compiled for Linux
@@ -60,6 +67,7 @@
 
 // Global Variables
 ThreadManager* threadManager;
+SphereKernel sphereKernel;
 std::ofstream frameLogFile;
 
 float mix(const float &a, const float &b, const float &mix)
@@ -67,6 +75,70 @@ float mix(const float &a, const float &b, const float &mix)
 	return b * mix + a * (1 - mix);
 }
 
+#pragma region Adaptive Termination
+
+// Secondary rays carrying less than this share of their pixel's colour are culled
+// (0 traces every ray to MAX_RAY_DEPTH), or kept by Russian roulette when enabled
+float contributionCutoff;
+bool russianRoulette;
+
+// Rays culled by every thread so far, and by this thread since it last reported
+std::atomic<unsigned long long> culledRayTotal(0);
+static thread_local unsigned long long culledRays = 0;
+
+static thread_local unsigned randomState = 0x9E3779B9u;
+
+// Cheap xorshift generator, one stream per thread, shared by Russian roulette and
+// light sampling. Returns a number in [0, 1).
+float threadRandom()
+{
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+
+	return (randomState >> 8) * (1.0f / 16777216.0f);
+}
+
+//[comment]
+// Decide whether a secondary ray with the given throughput is worth tracing.
+// Returns 0 if it is culled, otherwise the factor its throughput and colour are
+// scaled by, 1 for rays above the cutoff and 1 / survival probability for rays
+// kept by Russian roulette so the image stays unbiased.
+//[/comment]
+float rayContinuation(const Vec3f &throughput)
+{
+	float contribution = max(throughput.x, max(throughput.y, throughput.z));
+
+	if (contribution >= contributionCutoff)
+	{
+		return 1;
+	}
+
+	if (russianRoulette && contribution > 0)
+	{
+		float survival = contribution / contributionCutoff;
+
+		if (threadRandom() < survival)
+		{
+			return 1 / survival;
+		}
+	}
+
+	culledRays++;
+	return 0;
+}
+
+// Add the rays this thread culled to the total
+void reportCulledRays()
+{
+	culledRayTotal += culledRays;
+	culledRays = 0;
+}
+
+#pragma endregion
+
+Vec3f shade(const Vec3f &rayorig, const Vec3f &raydir, const SceneSnapshot &scene, const int &depth, const Vec3f &throughput, int hitIndex, float tnear);
+
 //[comment]
 // This is the main trace function. It takes a ray as argument (defined by its origin
 // and direction). We test if this ray intersects any of the geometry in the scene.
@@ -75,78 +147,189 @@ float mix(const float &a, const float &b, const float &mix)
 // Shading depends on the surface property (is it transparent, reflective, diffuse).
 // The function returns a color for the ray. If the ray intersects an object that
 // is the color of the object at the intersection point, otherwise it returns
-// the background color.
+// the background color. The throughput is the weight the ray's colour carries
+// into its pixel, used to stop tracing rays too faint to show.
 //[/comment]
-Vec3f trace(const Vec3f &rayorig, const Vec3f &raydir, const std::vector<SphereObj*> spheres, const int &depth)
+Vec3f trace(const Vec3f &rayorig, const Vec3f &raydir, const SceneSnapshot &scene, const int &depth, const Vec3f &throughput)
 {
 	//if (raydir.length() != 1) std::cerr << "Error " << raydir << std::endl;
 	float tnear = INFINITY;
-	const SphereObj* sphere = NULL;
 
-	// find intersection of this ray with the sphere in the scene
-	for (unsigned i = 0; i < spheres.size(); ++i)
+	// find intersection of this ray with the sphere in the scene, testing a block of spheres per SIMD instruction
+	int hitIndex = scene.IntersectNearest(rayorig, raydir, tnear);
+
+	return shade(rayorig, raydir, scene, depth, throughput, hitIndex, tnear);
+}
+
+//[comment]
+// Compute the point a ray hits and the normal there. If the normal and the view
+// direction are not opposite to each other, reverse the normal direction. That also
+// means we are inside the sphere so set the inside bool to true.
+//[/comment]
+void surfacePoint(const Vec3f &rayorig, const Vec3f &raydir, const SphereGeometry &geometry, float tnear, Vec3f &phit, Vec3f &nhit, bool &inside)
+{
+	phit = rayorig + raydir * tnear; // point of intersection
+	nhit = phit - geometry.center; // normal at the intersection point
+	nhit.normalize(); // normalize normal direction
+	inside = false;
+
+	if (raydir.dot(nhit) > 0)
 	{
-		float t0 = INFINITY, t1 = INFINITY;
-		if (spheres[i]->intersect(rayorig, raydir, t0, t1))
+		nhit = -nhit;
+		inside = true;
+	}
+}
+
+// Share of the colour carried by the reflection ray
+float fresnelEffect(const Vec3f &raydir, const Vec3f &nhit)
+{
+	float facingratio = -raydir.dot(nhit);
+
+	// change the mix value to tweak the effect
+	return mix(pow(1 - facingratio, 3), 1, 0.1);
+}
+
+Vec3f reflectDirection(const Vec3f &raydir, const Vec3f &nhit)
+{
+	// compute reflection direction (not need to normalize because all vectors are already normalized)
+	Vec3f refldir = raydir - nhit * 2 * raydir.dot(nhit);
+	refldir.normalize();
+
+	return refldir;
+}
+
+Vec3f refractDirection(const Vec3f &raydir, const Vec3f &nhit, bool inside)
+{
+	float ior = 1.1, eta = (inside) ? ior : 1 / ior; // are we inside or outside the surface?
+	float cosi = -nhit.dot(raydir);
+	float k = 1 - eta * eta * (1 - cosi * cosi);
+	Vec3f refrdir = raydir * eta + nhit * (eta *  cosi - sqrt(k));
+	refrdir.normalize();
+
+	return refrdir;
+}
+
+#pragma region Direct Lighting
+
+// Lights sampled per diffuse hit in scenes with more lights than this (0 = every
+// light is visited, the reference the sampled image converges to)
+int lightSamples;
+
+//[comment]
+// Light reaching a diffuse surface point directly from one emitter. A light behind
+// the surface adds nothing, so it is skipped before any shadow ray is traced.
+//[/comment]
+Vec3f lightContribution(const Vec3f &phit, const Vec3f &nhit, float bias, int hitIndex, const SphereMaterial* sphere, const SceneSnapshot &scene, unsigned lightIndex)
+{
+	Vec3f lightDirection = scene.GetGeometry(lightIndex).center - phit;
+	float lightDistance = lightDirection.length();
+	lightDirection.normalize();
+
+	float facing = nhit.dot(lightDirection);
+
+	if (facing <= 0)
+	{
+		return 0;
+	}
+
+	// only spheres between the point and the light cast a shadow
+	if (scene.Occluded(phit + nhit * bias, lightDirection, lightDistance, lightIndex, hitIndex))
+	{
+		return 0;
+	}
+
+	return sphere->surfaceColor * facing * scene.GetMaterial(lightIndex).emissionColor;
+}
+
+//[comment]
+// Light reaching a diffuse surface point directly from the emitters in the scene.
+// Scenes with more lights than lightSamples pick that many from the snapshot's
+// light tree, favouring bright lights the surface faces, and weight each by the
+// inverse of its probability so the estimate stays unbiased. The picks are
+// stratified over [0, 1) to spread them across the tree. Otherwise every light in
+// the snapshot's list is visited.
+//[/comment]
+Vec3f directLighting(const Vec3f &phit, const Vec3f &nhit, float bias, int hitIndex, const SphereMaterial* sphere, const SceneSnapshot &scene)
+{
+	Vec3f surfaceColor = 0;
+
+	if (lightSamples > 0 && scene.GetLightCount() > (unsigned)lightSamples)
+	{
+		const LightTree &lightTree = scene.GetLightTree();
+
+		for (int sample = 0; sample < lightSamples; ++sample)
 		{
-			if (t0 < 0)
-			{
-				t0 = t1;
-			}
+			float pdf;
+			float u = min((sample + threadRandom()) / lightSamples, 0.99999994f);
+			int i = lightTree.Sample(phit, nhit, u, pdf);
 
-			if (t0 < tnear)
+			// the walk ran into a branch no light of which can reach the point
+			if (i < 0)
 			{
-				tnear = t0;
-				sphere = spheres[i];
+				continue;
 			}
+
+			surfaceColor += lightContribution(phit, nhit, bias, hitIndex, sphere, scene, (unsigned)i) * (1 / (pdf * lightSamples));
 		}
+
+		return surfaceColor;
+	}
+
+	for (unsigned light = 0; light < scene.GetLightCount(); ++light)
+	{
+		surfaceColor += lightContribution(phit, nhit, bias, hitIndex, sphere, scene, scene.GetLight(light));
 	}
 
+	return surfaceColor;
+}
+
+#pragma endregion
+
+//[comment]
+// Shade the nearest hit of a ray, tracing any reflection and refraction rays it
+// spawns. Split from trace() so rays intersected in packets can be shaded one by one.
+//[/comment]
+Vec3f shade(const Vec3f &rayorig, const Vec3f &raydir, const SceneSnapshot &scene, const int &depth, const Vec3f &throughput, int hitIndex, float tnear)
+{
 	// if there's no intersection return black or background color
-	if (!sphere)
+	if (hitIndex < 0)
 	{
 		return Vec3f(2);
 	}
 
+	const SphereMaterial* sphere = &scene.GetMaterial(hitIndex);
+
 	Vec3f surfaceColor = 0; // color of the ray/surfaceof the object intersected by the ray
-	Vec3f phit = rayorig + raydir * tnear; // point of intersection
-	Vec3f nhit = phit - sphere->center; // normal at the intersection point
-	nhit.normalize(); // normalize normal direction
-					  // If the normal and the view direction are not opposite to each other
-					  // reverse the normal direction. That also means we are inside the sphere so set
-					  // the inside bool to true. Finally reverse the sign of IdotN which we want
-					  // positive.
+	Vec3f phit, nhit;
+	bool inside;
+	surfacePoint(rayorig, raydir, scene.GetGeometry(hitIndex), tnear, phit, nhit, inside);
 	float bias = 1e-4; // add some bias to the point from which we will be tracing
-	bool inside = false;
-
-	if (raydir.dot(nhit) > 0)
-	{
-		nhit = -nhit;
-		inside = true;
-	}
 
 	if ((sphere->transparency > 0 || sphere->reflection > 0) && depth < MAX_RAY_DEPTH) 
 	{
-		float facingratio = -raydir.dot(nhit);
+		float fresneleffect = fresnelEffect(raydir, nhit);
+		Vec3f reflection = 0;
+		Vec3f refraction = 0;
 
-		// change the mix value to tweak the effect
-		float fresneleffect = mix(pow(1 - facingratio, 3), 1, 0.1);
+		// skip rays whose share of the pixel is too small to show
+		Vec3f reflectionThroughput = throughput * sphere->surfaceColor * fresneleffect;
+		float reflectionWeight = rayContinuation(reflectionThroughput);
 
-		// compute reflection direction (not need to normalize because all vectors are already normalized)
-		Vec3f refldir = raydir - nhit * 2 * raydir.dot(nhit);
-		refldir.normalize();
-		Vec3f reflection = trace(phit + nhit * bias, refldir, spheres, depth + 1);
-		Vec3f refraction = 0;
+		if (reflectionWeight > 0)
+		{
+			reflection = trace(phit + nhit * bias, reflectDirection(raydir, nhit), scene, depth + 1, reflectionThroughput * reflectionWeight) * reflectionWeight;
+		}
 
 		// if the sphere is also transparent compute refraction ray (transmission)
 		if (sphere->transparency)
 		{
-			float ior = 1.1, eta = (inside) ? ior : 1 / ior; // are we inside or outside the surface?
-			float cosi = -nhit.dot(raydir);
-			float k = 1 - eta * eta * (1 - cosi * cosi);
-			Vec3f refrdir = raydir * eta + nhit * (eta *  cosi - sqrt(k));
-			refrdir.normalize();
-			refraction = trace(phit - nhit * bias, refrdir, spheres, depth + 1);
+			Vec3f refractionThroughput = throughput * sphere->surfaceColor * ((1 - fresneleffect) * sphere->transparency);
+			float refractionWeight = rayContinuation(refractionThroughput);
+
+			if (refractionWeight > 0)
+			{
+				refraction = trace(phit - nhit * bias, refractDirection(raydir, nhit, inside), scene, depth + 1, refractionThroughput * refractionWeight) * refractionWeight;
+			}
 		}
 		// the result is a mix of reflection and refraction (if the sphere is transparent)
 		surfaceColor = (reflection * fresneleffect + refraction * (1 - fresneleffect) * sphere->transparency) * sphere->surfaceColor;
@@ -154,46 +337,490 @@ Vec3f trace(const Vec3f &rayorig, const Vec3f &raydir, const std::vector<SphereO
 	else 
 	{
 		// it's a diffuse object, no need to raytrace any further
-		for (unsigned i = 0; i < spheres.size(); ++i)
+		surfaceColor = directLighting(phit, nhit, bias, hitIndex, sphere, scene);
+	}
+
+	return surfaceColor + sphere->emissionColor;
+}
+
+Vec3f primaryRayDirection(unsigned x, unsigned y, float invWidth, float invHeight, float angle, float aspectratio)
+{
+	float xx = (2 * ((x + 0.5) * invWidth) - 1) * angle * aspectratio;
+	float yy = (1 - 2 * ((y + 0.5) * invHeight)) * angle;
+	Vec3f raydir(xx, yy, -1);
+	raydir.normalize();
+
+	return raydir;
+}
+
+//[comment]
+// Nearest hit of a primary ray. When the frame is binned only the candidates of
+// the ray's screen bin are tested.
+//[/comment]
+int primaryHit(const Vec3f &raydir, const SceneSnapshot &scene, const ScreenBin* bin, float &tnear)
+{
+	return bin != nullptr ? bin->IntersectNearest(Vec3f(0), raydir, tnear) : scene.IntersectNearest(Vec3f(0), raydir, tnear);
+}
+
+void primaryPacketHits(const RayPacket &packet, const SceneSnapshot &scene, const ScreenBin* bin, float* tnear, int* hitIndex)
+{
+	if (bin != nullptr)
+	{
+		bin->IntersectNearest(packet, tnear, hitIndex);
+	}
+	else
+	{
+		scene.IntersectNearest(packet, tnear, hitIndex);
+	}
+}
+
+void renderPixel(Vec3f* pixel, unsigned x, unsigned y, float invWidth, float invHeight, float angle, float aspectratio, const SceneSnapshot &scene, const ScreenBin* bin)
+{
+	Vec3f raydir = primaryRayDirection(x, y, invWidth, invHeight, angle, aspectratio);
+
+	float tnear = INFINITY;
+	int hitIndex = primaryHit(raydir, scene, bin, tnear);
+
+	*pixel = shade(Vec3f(0), raydir, scene, 0, Vec3f(1), hitIndex, tnear);
+}
+
+//[comment]
+// Trace a packet of neighbouring primary rays together. The camera rays of nearby
+// pixels are nearly parallel, so they are intersected with the scene in one SIMD
+// pass, then each hit is shaded and its secondary rays traced one at a time.
+//[/comment]
+void renderPacket(Vec3f* image, unsigned width, unsigned x0, unsigned y0, unsigned x1, unsigned y1, float invWidth, float invHeight, float angle, float aspectratio, const SceneSnapshot &scene, const ScreenBin* bin)
+{
+	RayPacket packet;
+	packet.origin = Vec3f(0);
+	packet.size = 0;
+
+	for (unsigned y = y0; y < y1; y++)
+	{
+		for (unsigned x = x0; x < x1; x++, packet.size++)
+		{
+			Vec3f raydir = primaryRayDirection(x, y, invWidth, invHeight, angle, aspectratio);
+			packet.directionX[packet.size] = raydir.x;
+			packet.directionY[packet.size] = raydir.y;
+			packet.directionZ[packet.size] = raydir.z;
+		}
+	}
+
+	// Fill the unused lanes of a packet clipped by the image edge
+	for (unsigned lane = packet.size; lane < RAY_PACKET_SIZE; lane++)
+	{
+		packet.directionX[lane] = packet.directionX[0];
+		packet.directionY[lane] = packet.directionY[0];
+		packet.directionZ[lane] = packet.directionZ[0];
+	}
+
+	alignas(64) float tnear[RAY_PACKET_SIZE];
+	alignas(64) int hitIndex[RAY_PACKET_SIZE];
+
+	for (unsigned lane = 0; lane < RAY_PACKET_SIZE; lane++)
+	{
+		tnear[lane] = INFINITY;
+	}
+
+	primaryPacketHits(packet, scene, bin, tnear, hitIndex);
+
+	unsigned lane = 0;
+
+	for (unsigned y = y0; y < y1; y++)
+	{
+		for (unsigned x = x0; x < x1; x++, lane++)
+		{
+			Vec3f raydir(packet.directionX[lane], packet.directionY[lane], packet.directionZ[lane]);
+			image[y * width + x] = shade(packet.origin, raydir, scene, 0, Vec3f(1), hitIndex[lane], tnear[lane]);
+		}
+	}
+}
+
+#pragma region Wavefront Tracing
+
+// Pixels traced together by one wavefront, small enough for its ray queues to stay in cache
+#define WAVEFRONT_BLOCK_SIZE 16
+
+// A ray waiting in a wavefront queue. The throughput is the weight its colour
+// carries into the pixel, the product of the shading factors along its path.
+struct WavefrontRay
+{
+	Vec3f origin, direction;
+	Vec3f throughput;
+	unsigned pixel;
+};
+
+// Ray queues of one depth and the next, with the nearest hit of every queued ray.
+// Kept per thread and reused for every block.
+struct WavefrontQueues
+{
+	std::vector<WavefrontRay> rays;
+	std::vector<WavefrontRay> nextRays;
+
+	std::vector<float> tnear;
+	std::vector<int> hitIndex;
+};
+
+static thread_local WavefrontQueues wavefrontQueues;
+
+void queuePrimaryRay(WavefrontQueues &queues, const Vec3f &raydir, unsigned pixel)
+{
+	WavefrontRay ray;
+	ray.origin = Vec3f(0);
+	ray.direction = raydir;
+	ray.throughput = Vec3f(1);
+	ray.pixel = pixel;
+
+	queues.rays.push_back(ray);
+}
+
+//[comment]
+// Queue the camera rays of a block along with their nearest hits, intersecting
+// them in packets when enabled
+//[/comment]
+void queuePrimaryRays(WavefrontQueues &queues, unsigned width, unsigned x0, unsigned y0, unsigned x1, unsigned y1, float invWidth, float invHeight, float angle, float aspectratio, const SceneSnapshot &scene, const ScreenBin* bin, bool rayPackets)
+{
+	unsigned packetWidth = 1, packetHeight = 1;
+
+	if (rayPackets)
+	{
+		GetRayPacketShape(packetWidth, packetHeight);
+	}
+
+	if (packetWidth * packetHeight == 1)
+	{
+		for (unsigned y = y0; y < y1; y++)
 		{
-			if (spheres[i]->emissionColor.x > 0)
+			for (unsigned x = x0; x < x1; x++)
 			{
-				// this is a light
-				Vec3f transmission = 1;
-				Vec3f lightDirection = spheres[i]->center - phit;
-				lightDirection.normalize();
-				for (unsigned j = 0; j < spheres.size(); ++j)
+				queuePrimaryRay(queues, primaryRayDirection(x, y, invWidth, invHeight, angle, aspectratio), y * width + x);
+
+				float tnear = INFINITY;
+				queues.hitIndex.push_back(primaryHit(queues.rays.back().direction, scene, bin, tnear));
+				queues.tnear.push_back(tnear);
+			}
+		}
+
+		return;
+	}
+
+	RayPacket packet;
+	packet.origin = Vec3f(0);
+
+	alignas(64) float tnear[RAY_PACKET_SIZE];
+	alignas(64) int hitIndex[RAY_PACKET_SIZE];
+
+	for (unsigned py = y0; py < y1; py += packetHeight)
+	{
+		for (unsigned px = x0; px < x1; px += packetWidth)
+		{
+			size_t firstRay = queues.rays.size();
+
+			for (unsigned y = py; y < min(py + packetHeight, y1); y++)
+			{
+				for (unsigned x = px; x < min(px + packetWidth, x1); x++)
 				{
-					if (i != j)
-					{
-						float t0, t1;
-
-						if (spheres[j]->intersect(phit + nhit * bias, lightDirection, t0, t1))
-						{
-							transmission = 0;
-							break;
-						}
-					}
+					queuePrimaryRay(queues, primaryRayDirection(x, y, invWidth, invHeight, angle, aspectratio), y * width + x);
 				}
+			}
+
+			packet.size = (unsigned)(queues.rays.size() - firstRay);
 
-				surfaceColor += sphere->surfaceColor * transmission * max(float(0), nhit.dot(lightDirection)) * spheres[i]->emissionColor;
+			for (unsigned lane = 0; lane < RAY_PACKET_SIZE; lane++)
+			{
+				// Unused lanes of a packet clipped by the block edge repeat its first ray
+				const Vec3f &raydir = queues.rays[firstRay + (lane < packet.size ? lane : 0)].direction;
+				packet.directionX[lane] = raydir.x;
+				packet.directionY[lane] = raydir.y;
+				packet.directionZ[lane] = raydir.z;
+				tnear[lane] = INFINITY;
 			}
+
+			primaryPacketHits(packet, scene, bin, tnear, hitIndex);
+
+			queues.tnear.insert(queues.tnear.end(), tnear, tnear + packet.size);
+			queues.hitIndex.insert(queues.hitIndex.end(), hitIndex, hitIndex + packet.size);
 		}
 	}
+}
 
-	return surfaceColor + sphere->emissionColor;
+//[comment]
+// Shading kernel of the wavefront. Adds the colour a ray gathers at its hit to its
+// pixel, weighted by its throughput, and queues the reflection and refraction rays
+// it spawns for the next depth with the weights trace() would mix them by.
+//[/comment]
+void shadeWavefrontRay(const WavefrontRay &ray, int hitIndex, float tnear, int depth, const SceneSnapshot &scene, Vec3f* image, std::vector<WavefrontRay> &nextRays)
+{
+	// if there's no intersection add the background color
+	if (hitIndex < 0)
+	{
+		image[ray.pixel] += ray.throughput * Vec3f(2);
+		return;
+	}
+
+	const SphereMaterial* sphere = &scene.GetMaterial(hitIndex);
+
+	Vec3f phit, nhit;
+	bool inside;
+	surfacePoint(ray.origin, ray.direction, scene.GetGeometry(hitIndex), tnear, phit, nhit, inside);
+	float bias = 1e-4;
+
+	if ((sphere->transparency > 0 || sphere->reflection > 0) && depth < MAX_RAY_DEPTH)
+	{
+		float fresneleffect = fresnelEffect(ray.direction, nhit);
+		Vec3f throughput = ray.throughput * sphere->surfaceColor;
+
+		// rays too faint to show are never queued
+		Vec3f reflectionThroughput = throughput * fresneleffect;
+		float reflectionWeight = rayContinuation(reflectionThroughput);
+
+		if (reflectionWeight > 0)
+		{
+			WavefrontRay reflection;
+			reflection.origin = phit + nhit * bias;
+			reflection.direction = reflectDirection(ray.direction, nhit);
+			reflection.throughput = reflectionThroughput * reflectionWeight;
+			reflection.pixel = ray.pixel;
+			nextRays.push_back(reflection);
+		}
+
+		if (sphere->transparency)
+		{
+			Vec3f refractionThroughput = throughput * ((1 - fresneleffect) * sphere->transparency);
+			float refractionWeight = rayContinuation(refractionThroughput);
+
+			if (refractionWeight > 0)
+			{
+				WavefrontRay refraction;
+				refraction.origin = phit - nhit * bias;
+				refraction.direction = refractDirection(ray.direction, nhit, inside);
+				refraction.throughput = refractionThroughput * refractionWeight;
+				refraction.pixel = ray.pixel;
+				nextRays.push_back(refraction);
+			}
+		}
+	}
+	else
+	{
+		image[ray.pixel] += ray.throughput * directLighting(phit, nhit, bias, hitIndex, sphere, scene);
+	}
+
+	image[ray.pixel] += ray.throughput * sphere->emissionColor;
 }
 
-void renderPixel(Vec3f* pixel, unsigned x, unsigned y, float invWidth, float invHeight, float angle, float aspectratio, const std::vector<SphereObj*> spheres)
+// Empty the queues and clear the pixels of a block before its camera rays are queued
+void beginWavefront(WavefrontQueues &queues, Vec3f* image, unsigned width, unsigned x0, unsigned y0, unsigned x1, unsigned y1)
 {
-	float xx = (2 * ((x + 0.5) * invWidth) - 1) * angle * aspectratio;
-	float yy = (1 - 2 * ((y + 0.5) * invHeight)) * angle;
-	Vec3f raydir(xx, yy, -1);
-	raydir.normalize();
-	*pixel = trace(Vec3f(0), raydir, spheres, 0);
+	queues.rays.clear();
+	queues.tnear.clear();
+	queues.hitIndex.clear();
+
+	for (unsigned y = y0; y < y1; y++)
+	{
+		for (unsigned x = x0; x < x1; x++)
+		{
+			image[y * width + x] = Vec3f(0);
+		}
+	}
+}
+
+//[comment]
+// Trace the queued camera rays breadth first. Instead of recursing per pixel, every
+// ray of one depth is kept in a queue, intersected in one pass and shaded in a
+// second pass that fills the queue of the next depth, until no rays are left.
+//[/comment]
+void traceWavefront(WavefrontQueues &queues, const SceneSnapshot &scene, Vec3f* image)
+{
+	for (int depth = 0; !queues.rays.empty(); depth++)
+	{
+		// Shade every hit of this depth, queueing the rays of the next
+		queues.nextRays.clear();
+
+		for (size_t i = 0; i < queues.rays.size(); i++)
+		{
+			shadeWavefrontRay(queues.rays[i], queues.hitIndex[i], queues.tnear[i], depth, scene, image, queues.nextRays);
+		}
+
+		queues.rays.swap(queues.nextRays);
+
+		// Find the nearest hit of every ray of the next depth
+		size_t rayCount = queues.rays.size();
+		queues.tnear.resize(rayCount);
+		queues.hitIndex.resize(rayCount);
+
+		for (size_t i = 0; i < rayCount; i++)
+		{
+			queues.tnear[i] = INFINITY;
+			queues.hitIndex[i] = scene.IntersectNearest(queues.rays[i].origin, queues.rays[i].direction, queues.tnear[i]);
+		}
+	}
+}
+
+void renderWavefront(Vec3f* image, unsigned width, unsigned x0, unsigned y0, unsigned x1, unsigned y1, float invWidth, float invHeight, float angle, float aspectratio, const SceneSnapshot &scene, const ScreenBin* bin, bool rayPackets)
+{
+	WavefrontQueues &queues = wavefrontQueues;
+
+	beginWavefront(queues, image, width, x0, y0, x1, y1);
+	queuePrimaryRays(queues, width, x0, y0, x1, y1, invWidth, invHeight, angle, aspectratio, scene, bin, rayPackets);
+	traceWavefront(queues, scene, image);
+}
+
+#pragma endregion
+
+//[comment]
+// Trace every pixel of a rectangle of the image, in ray packets or wavefront
+// blocks when enabled. Primary rays only test the candidates of the bin when given.
+//[/comment]
+void traceRegion(Vec3f* image, unsigned width, unsigned x0, unsigned y0, unsigned x1, unsigned y1, float invWidth, float invHeight, float angle, float aspectratio, const SceneSnapshot &scene, const ScreenBin* bin, const ConfigurationSettings &configSettings)
+{
+	if (configSettings.wavefrontTracing)
+	{
+		for (unsigned y = y0; y < y1; y += WAVEFRONT_BLOCK_SIZE)
+		{
+			for (unsigned x = x0; x < x1; x += WAVEFRONT_BLOCK_SIZE)
+			{
+				renderWavefront(image, width, x, y, min(x + WAVEFRONT_BLOCK_SIZE, x1), min(y + WAVEFRONT_BLOCK_SIZE, y1), invWidth, invHeight, angle, aspectratio, scene, bin, configSettings.rayPackets);
+			}
+		}
+
+		return;
+	}
+
+	unsigned packetWidth = 1, packetHeight = 1;
+
+	if (configSettings.rayPackets)
+	{
+		GetRayPacketShape(packetWidth, packetHeight);
+	}
+
+	if (packetWidth * packetHeight == 1)
+	{
+		for (unsigned y = y0; y < y1; y++)
+		{
+			Vec3f* pixel = image + y * width + x0;
+
+			for (unsigned x = x0; x < x1; x++, pixel++)
+			{
+				renderPixel(pixel, x, y, invWidth, invHeight, angle, aspectratio, scene, bin);
+			}
+		}
+
+		return;
+	}
+
+	for (unsigned y = y0; y < y1; y += packetHeight)
+	{
+		for (unsigned x = x0; x < x1; x += packetWidth)
+		{
+			renderPacket(image, width, x, y, min(x + packetWidth, x1), min(y + packetHeight, y1), invWidth, invHeight, angle, aspectratio, scene, bin);
+		}
+	}
+}
+
+//[comment]
+// Hybrid rendering of the pixels of one screen bin. Every primary ray starts at the
+// camera, so instead of tracing them the bin's spheres are rasterized into a buffer
+// holding the nearest sphere and its distance for each pixel. The pixels are then
+// shaded from the buffer and only their secondary and shadow rays are traced.
+//[/comment]
+void rasterizeBin(Vec3f* image, unsigned width, unsigned x0, unsigned y0, unsigned x1, unsigned y1, float invWidth, float invHeight, float angle, float aspectratio, const SceneSnapshot &scene, const ScreenBin &bin, bool wavefrontTracing)
+{
+	Vec3f raydirs[SCREEN_BIN_SIZE * SCREEN_BIN_SIZE];
+	float tnear[SCREEN_BIN_SIZE * SCREEN_BIN_SIZE];
+	int hitIndex[SCREEN_BIN_SIZE * SCREEN_BIN_SIZE];
+
+	unsigned pixel = 0;
+
+	for (unsigned y = y0; y < y1; y++)
+	{
+		for (unsigned x = x0; x < x1; x++, pixel++)
+		{
+			raydirs[pixel] = primaryRayDirection(x, y, invWidth, invHeight, angle, aspectratio);
+		}
+	}
+
+	bin.Rasterize(x0, y0, x1, y1, raydirs, tnear, hitIndex);
+
+	if (wavefrontTracing)
+	{
+		WavefrontQueues &queues = wavefrontQueues;
+		beginWavefront(queues, image, width, x0, y0, x1, y1);
+
+		pixel = 0;
+
+		for (unsigned y = y0; y < y1; y++)
+		{
+			for (unsigned x = x0; x < x1; x++, pixel++)
+			{
+				queuePrimaryRay(queues, raydirs[pixel], y * width + x);
+			}
+		}
+
+		queues.tnear.assign(tnear, tnear + pixel);
+		queues.hitIndex.assign(hitIndex, hitIndex + pixel);
+
+		traceWavefront(queues, scene, image);
+		return;
+	}
+
+	pixel = 0;
+
+	for (unsigned y = y0; y < y1; y++)
+	{
+		for (unsigned x = x0; x < x1; x++, pixel++)
+		{
+			image[y * width + x] = shade(Vec3f(0), raydirs[pixel], scene, 0, Vec3f(1), hitIndex[pixel], tnear[pixel]);
+		}
+	}
+}
+
+//[comment]
+// Trace every pixel of a rectangle of the image. A binned frame is traced one
+// screen bin at a time, and the pixels of an empty bin get the background colour
+// without a single intersection test. In the hybrid mode the primary hits of each
+// bin come from rasterizing it.
+//[/comment]
+void renderRegion(Vec3f* image, unsigned width, unsigned x0, unsigned y0, unsigned x1, unsigned y1, float invWidth, float invHeight, float angle, float aspectratio, const SceneSnapshot &scene, const ScreenBins* screenBins, const ConfigurationSettings &configSettings)
+{
+	if (screenBins == nullptr)
+	{
+		traceRegion(image, width, x0, y0, x1, y1, invWidth, invHeight, angle, aspectratio, scene, nullptr, configSettings);
+		return;
+	}
+
+	for (unsigned by = y0; by < y1; by = (by / SCREEN_BIN_SIZE + 1) * SCREEN_BIN_SIZE)
+	{
+		unsigned by1 = min((by / SCREEN_BIN_SIZE + 1) * SCREEN_BIN_SIZE, y1);
+
+		for (unsigned bx = x0; bx < x1; bx = (bx / SCREEN_BIN_SIZE + 1) * SCREEN_BIN_SIZE)
+		{
+			unsigned bx1 = min((bx / SCREEN_BIN_SIZE + 1) * SCREEN_BIN_SIZE, x1);
+			const ScreenBin &bin = screenBins->GetBin(bx, by);
+
+			if (bin.count > 0 && configSettings.rasterizePrimary)
+			{
+				rasterizeBin(image, width, bx, by, bx1, by1, invWidth, invHeight, angle, aspectratio, scene, bin, configSettings.wavefrontTracing);
+				continue;
+			}
+
+			if (bin.count > 0)
+			{
+				traceRegion(image, width, bx, by, bx1, by1, invWidth, invHeight, angle, aspectratio, scene, &bin, configSettings);
+				continue;
+			}
+
+			for (unsigned y = by; y < by1; y++)
+			{
+				for (unsigned x = bx; x < bx1; x++)
+				{
+					image[y * width + x] = Vec3f(2);
+				}
+			}
+		}
+	}
 }
 
-void saveSphereImage(ConfigurationSettings configSettings, int iteration, Vec3f* image, unsigned width, unsigned height)
+void saveSphereImage(const ConfigurationSettings &configSettings, int iteration, Vec3f* image, unsigned width, unsigned height)
 {
 	// Save result to a PPM image (keep these flags if you compile under Windows)
 	std::stringstream ss;
@@ -213,7 +840,6 @@ void saveSphereImage(ConfigurationSettings configSettings, int iteration, Vec3f*
 	}
 
 	ofs.close();
-	delete[] image;
 }
 
 std::vector<SphereObj*> RetrieveRootSpheres(std::vector<SphereObj*> spheres)
@@ -233,37 +859,155 @@ std::vector<SphereObj*> RetrieveRootSpheres(std::vector<SphereObj*> spheres)
 	return rootSpheres;
 }
 
+// Screen bins of the frame this thread is rendering, reused from frame to frame
+static thread_local ScreenBins screenBins;
+
 //[comment]
 // Main rendering function. We compute a camera ray for each pixel of the image
 // trace it and return a color. If the ray hits a sphere, we return the color of the
 // sphere at the intersection point, else we return the background color.
 //[/comment]
-void render(std::vector<SphereObj*> spheresToRender, int iteration, ConfigurationSettings configSettings, unsigned width, unsigned height, UINT frameTotal)
+void render(const SceneSnapshot &scene, int iteration, const ConfigurationSettings &configSettings, unsigned width, unsigned height, UINT frameTotal, FramebufferPool &framebufferPool)
 {
 	std::chrono::time_point<std::chrono::system_clock> frameStart;
 	frameStart = std::chrono::system_clock::now();
 	std::chrono::time_point<std::chrono::system_clock> frameEnd;
 
-	Vec3f* image = new Vec3f[width * height];
-	Vec3f* pixel = image;
+	// Reused from the pool, preferring one on this worker's NUMA node
+	int imageIndex;
+	Vec3f* image = framebufferPool.Acquire(imageIndex);
 	float invWidth = 1 / float(width), invHeight = 1 / float(height);
 	float fov = 30, aspectratio = width / float(height);
 	float angle = tan(M_PI * 0.5f * fov / 180.0f);
 
-	// Trace rays
-	for (unsigned y = 0; y < height; y++)
+	// Sort the spheres into the screen bins they can cover, which the hybrid mode
+	// rasterizes
+	const ScreenBins* bins = nullptr;
+
+	if (configSettings.screenBinning || configSettings.rasterizePrimary)
 	{
-		for (unsigned x = 0; x < width; x++, pixel++)
-		{
-			renderPixel(pixel, x, y, invWidth, invHeight, angle, aspectratio, spheresToRender);
-		}
+		screenBins.Build(scene, width, height, angle, aspectratio);
+		bins = &screenBins;
 	}
 
+	// Trace rays
+	renderRegion(image, width, 0, 0, width, height, invWidth, invHeight, angle, aspectratio, scene, bins, configSettings);
+	reportCulledRays();
+
 	// Save result to a PPM image (keep these flags if you compile under Windows)
 	saveSphereImage(configSettings, iteration, image, width, height);
+	framebufferPool.Release(imageIndex);
+
+	frameEnd = std::chrono::system_clock::now();
+	std::chrono::duration<double> frameDuration = frameEnd - frameStart;
+
+	std::cout << "\nFrame " << iteration + 1 << ": " << frameDuration.count() << "\t| Render Completion: " << iteration + 1 << "/" << frameTotal;
+	frameLogFile << "\nFrame " << iteration + 1 << ": " << frameDuration.count() << "\t| Render Completion: " << iteration + 1 << "/" << frameTotal;
+}
+
+// Everything a queued frame render needs. Queued by pointer so the task fits in
+// the thread pool's inline task storage.
+struct FrameJob
+{
+	SceneSnapshot* scene;
+	SceneSnapshotPool* scenePool;
+	int iteration;
+	const ConfigurationSettings* configSettings;
+	unsigned width, height;
+	UINT frameTotal;
+
+	FrameThrottle* frameThrottle;
+	size_t frameBytes;
+
+	FramebufferPool* framebufferPool;
+};
+
+void renderFrameJob(FrameJob* job)
+{
+	render(*job->scene, job->iteration, *job->configSettings, job->width, job->height, job->frameTotal, *job->framebufferPool);
+
+	// The frame has been written, let the producer animate the next one
+	job->scenePool->Release(job->scene);
+	job->frameThrottle->Release(job->frameBytes);
+
+	delete job;
+}
 
-	/*std::function<void()> function = std::bind(&saveSphereImage, configSettings, iteration, image, width, height);
-	threadManager->AddTask(function);*/
+#pragma region Tile Rendering
+
+// Frame state shared by every tile task of a tile-parallel render
+struct TileFrame
+{
+	const SceneSnapshot* scene;
+	Vec3f* image;
+	unsigned width, height;
+	unsigned tileSize, tilesX;
+	float invWidth, invHeight, angle, aspectratio;
+	const ScreenBins* screenBins;
+	const ConfigurationSettings* configSettings;
+};
+
+//[comment]
+// Trace every pixel of one screen tile
+//[/comment]
+void renderTile(TileFrame* frame, unsigned tileIndex)
+{
+	unsigned x0 = (tileIndex % frame->tilesX) * frame->tileSize;
+	unsigned y0 = (tileIndex / frame->tilesX) * frame->tileSize;
+	unsigned x1 = min(x0 + frame->tileSize, frame->width);
+	unsigned y1 = min(y0 + frame->tileSize, frame->height);
+
+	renderRegion(frame->image, frame->width, x0, y0, x1, y1, frame->invWidth, frame->invHeight, frame->angle, frame->aspectratio, *frame->scene, frame->screenBins, *frame->configSettings);
+	reportCulledRays();
+}
+
+//[comment]
+// Tile-parallel rendering function. The frame is split into tileSize x tileSize
+// screen tiles which are scheduled across every worker thread, so a single frame
+// is finished as fast as the whole pool can trace it. Blocks until the frame has
+// been traced and saved.
+//[/comment]
+void renderTiled(const SceneSnapshot &scene, int iteration, const ConfigurationSettings &configSettings, unsigned width, unsigned height, UINT frameTotal, FramebufferPool &framebufferPool)
+{
+	std::chrono::time_point<std::chrono::system_clock> frameStart;
+	frameStart = std::chrono::system_clock::now();
+	std::chrono::time_point<std::chrono::system_clock> frameEnd;
+
+	int imageIndex;
+	TileFrame frame;
+	frame.scene = &scene;
+	// Pages of a new framebuffer are first touched, and so placed, by the workers tracing each tile
+	frame.image = framebufferPool.Acquire(imageIndex);
+	frame.width = width;
+	frame.height = height;
+	frame.tileSize = max(configSettings.tileSize, 1);
+	frame.tilesX = (width + frame.tileSize - 1) / frame.tileSize;
+	frame.invWidth = 1 / float(width);
+	frame.invHeight = 1 / float(height);
+	float fov = 30;
+	frame.aspectratio = width / float(height);
+	frame.angle = tan(M_PI * 0.5f * fov / 180.0f);
+	frame.screenBins = nullptr;
+	frame.configSettings = &configSettings;
+
+	// Bin the spheres once for all tiles of the frame
+	if (configSettings.screenBinning || configSettings.rasterizePrimary)
+	{
+		screenBins.Build(scene, width, height, frame.angle, frame.aspectratio);
+		frame.screenBins = &screenBins;
+	}
+
+	unsigned tilesY = (height + frame.tileSize - 1) / frame.tileSize;
+	unsigned tileTotal = frame.tilesX * tilesY;
+
+	TaskGroup tiles;
+	threadManager->AddTaskRange(0, tileTotal, std::bind(&renderTile, &frame, std::placeholders::_1), tiles);
+
+	// Wait for the last tile before the frame goes out of scope
+	threadManager->Wait(tiles);
+
+	saveSphereImage(configSettings, iteration, frame.image, width, height);
+	framebufferPool.Release(imageIndex);
 
 	frameEnd = std::chrono::system_clock::now();
 	std::chrono::duration<double> frameDuration = frameEnd - frameStart;
@@ -272,8 +1016,23 @@ void render(std::vector<SphereObj*> spheresToRender, int iteration, Configuratio
 	frameLogFile << "\nFrame " << iteration + 1 << ": " << frameDuration.count() << "\t| Render Completion: " << iteration + 1 << "/" << frameTotal;
 }
 
+#pragma endregion
+
 #pragma region Setup Solar System
 
+// Return the text of an optional setting, or the default if it is missing from the XML file
+std::string ReadOptionalSetting(tinyxml2::XMLElement* element, const char* settingName, const std::string &defaultValue)
+{
+	tinyxml2::XMLElement* settingElement = element->FirstChildElement(settingName);
+
+	if (settingElement == NULL || settingElement->GetText() == NULL)
+	{
+		return defaultValue;
+	}
+
+	return settingElement->GetText();
+}
+
 ConfigurationSettings ImportSetupFromXMLFile(tinyxml2::XMLDocument &xmlDocument)
 {
 	ConfigurationSettings configSettings;
@@ -289,6 +1048,27 @@ ConfigurationSettings ImportSetupFromXMLFile(tinyxml2::XMLDocument &xmlDocument)
 
 	configSettings.filePath = element->FirstChildElement("appOutputDirectory")->GetText();
 
+	// Optional render settings
+	configSettings.tileRendering		= ReadOptionalSetting(element, "appRenderMode", "frame") == "tile";
+	configSettings.tileSize				= atoi(ReadOptionalSetting(element, "appTileSize", "32").c_str());
+	configSettings.threadCount			= atoi(ReadOptionalSetting(element, "appThreadCount", "0").c_str());
+	configSettings.pinThreads			= ReadOptionalSetting(element, "appPinThreads", "false") == "true";
+	configSettings.maxFramesInFlight	= atoi(ReadOptionalSetting(element, "appMaxFramesInFlight", "0").c_str());
+	configSettings.frameMemoryBudget	= size_t(atoi(ReadOptionalSetting(element, "appFrameMemoryBudgetMB", "0").c_str())) * 1024 * 1024;
+	configSettings.largePages			= ReadOptionalSetting(element, "appLargePages", "false") == "true";
+	configSettings.intersectionKernel	= ReadOptionalSetting(element, "appIntersectionKernel", "auto");
+	configSettings.rayPackets			= ReadOptionalSetting(element, "appRayPackets", "true") == "true";
+	configSettings.wavefrontTracing		= ReadOptionalSetting(element, "appTraceMode", "recursive") == "wavefront";
+	configSettings.contributionCutoff	= strtof(ReadOptionalSetting(element, "appContributionCutoff", "0").c_str(), NULL);
+	configSettings.russianRoulette		= ReadOptionalSetting(element, "appRussianRoulette", "false") == "true";
+	configSettings.bvhMinSpheres		= atoi(ReadOptionalSetting(element, "appBvhMinSpheres", "256").c_str());
+	configSettings.bvhRebuildThreshold	= strtof(ReadOptionalSetting(element, "appBvhRebuildThreshold", "1.5").c_str(), NULL);
+	configSettings.staticBvh			= ReadOptionalSetting(element, "appStaticBvh", "true") == "true";
+	configSettings.screenBinning		= ReadOptionalSetting(element, "appScreenBinning", "false") == "true";
+	configSettings.rasterizePrimary		= ReadOptionalSetting(element, "appPrimaryVisibility", "trace") == "raster";
+	configSettings.orbitHierarchy		= ReadOptionalSetting(element, "appOrbitHierarchy", "true") == "true";
+	configSettings.lightSamples			= atoi(ReadOptionalSetting(element, "appLightSamples", "0").c_str());
+
 	return configSettings;
 }
 
@@ -311,6 +1091,40 @@ void SortSphereHierarchy(std::vector<SphereObj*> &spheres)
 	}
 }
 
+// Does the sphere keep the same position for the whole clip. Root spheres drift
+// towards the camera every frame, children orbit their parent unless their
+// rotation speed is zero and the parent stays put in x and y, which roots do.
+bool IsStaticSphere(SphereObj* sphere, size_t depthLeft)
+{
+	if (sphere->GetRootSphere())
+	{
+		return false;
+	}
+
+	SphereObj* parentSphere = sphere->GetParentSphere();
+
+	// Orphaned spheres are never animated
+	if (parentSphere == nullptr)
+	{
+		return true;
+	}
+
+	if (sphere->GetRotationSpeed() != 0.0f || depthLeft == 0)
+	{
+		return false;
+	}
+
+	return parentSphere->GetRootSphere() || IsStaticSphere(parentSphere, depthLeft - 1);
+}
+
+void ClassifyStaticSpheres(std::vector<SphereObj*> &spheres)
+{
+	for each(SphereObj* sphere in spheres)
+	{
+		sphere->SetStaticSphere(IsStaticSphere(sphere, spheres.size()));
+	}
+}
+
 std::vector<SphereObj*> ImportSolarSystemFromXML(tinyxml2::XMLDocument &xmlDocument)
 {
 	std::string sphereName;
@@ -368,10 +1182,11 @@ std::vector<SphereObj*> ImportSolarSystemFromXML(tinyxml2::XMLDocument &xmlDocum
 			rootSphere = false;
 		}
 
-		// Temporarily set Emission, Transparency and Reflection to hard-coded values.
-		newSphere->SetEmissionColour(0.0f);
-		newSphere->SetTransparency(0.5f);
-		newSphere->SetReflection(1.0f);
+		// Set Sphere emission, transparency and reflection, defaulting to a clear mirror-like sphere that emits no light
+		tinyxml2::XMLElement* sphereElement = node->ToElement();
+		newSphere->SetEmissionColour(strtof(ReadOptionalSetting(sphereElement, "emission", "0").c_str(), NULL));
+		newSphere->SetTransparency(strtof(ReadOptionalSetting(sphereElement, "transparency", "0.5").c_str(), NULL));
+		newSphere->SetReflection(strtof(ReadOptionalSetting(sphereElement, "reflection", "1").c_str(), NULL));
 
 		newSphere->SetRootSphere(rootSphere);
 
@@ -392,6 +1207,7 @@ std::vector<SphereObj*> ImportSolarSystemFromXML(tinyxml2::XMLDocument &xmlDocum
 	}
 
 	SortSphereHierarchy(spheres);
+	ClassifyStaticSpheres(spheres);
 
 	return spheres;
 }
@@ -416,7 +1232,7 @@ std::vector<SphereObj*> RetrieveSphereChildren(SphereObj* rootSphere)
 	return spheres;
 }
 
-void PlanetRotation(ConfigurationSettings configSettings, std::vector<SphereObj*> spheresImported, std::ofstream &frameLogFile)
+void PlanetRotation(const ConfigurationSettings &configSettings, std::vector<SphereObj*> spheresImported, std::ofstream &frameLogFile)
 {
 	std::cout << "\n";
 
@@ -427,11 +1243,46 @@ void PlanetRotation(ConfigurationSettings configSettings, std::vector<SphereObj*
 	UINT FPS = configSettings.frameRate;
 	UINT frameTotal = videoLength * FPS;
 
+	// Bound the frames queued or rendering at once, by default enough to keep every worker busy
+	int maxFramesInFlight = configSettings.maxFramesInFlight > 0 ? configSettings.maxFramesInFlight : 2 * threadManager->GetThreadCount();
+	FrameThrottle frameThrottle(maxFramesInFlight, configSettings.frameMemoryBudget);
+	FramebufferPool framebufferPool(width * height, configSettings.largePages);
+	SceneSnapshotPool scenePool;
+
+	unsigned staticSphereCount = 0, lightCount = 0;
+
+	for each(SphereObj* sphere in spheresImported)
+	{
+		if (sphere->GetStaticSphere())
+		{
+			staticSphereCount++;
+		}
+
+		if (sphere->GetEmissionColour().x > 0)
+		{
+			lightCount++;
+		}
+	}
+
+	// Large scenes build a BVH once and refit it every frame, optionally leaving the
+	// static spheres in a tree of their own that is never refitted
+	SphereBVHBuilder bvhBuilder(max(configSettings.bvhMinSpheres, 0), configSettings.bvhRebuildThreshold, configSettings.staticBvh);
+
+	// Smaller scenes reject whole planetary systems by their bounds. A 16 wide scan
+	// of every sphere still beats the bounds tests for nearest hits, so with the
+	// AVX-512 kernel only shadow rays use them.
+	OrbitHierarchyBuilder hierarchyBuilder(configSettings.orbitHierarchy, sphereKernel != SPHERE_KERNEL_AVX512);
+	TaskGroup frames;
+
+	// Memory a frame holds until it is written, its framebuffer and scene snapshot
+	size_t frameBytes = sizeof(Vec3f) * width * height + SceneSnapshot::GetFrameBytes(spheresImported.size(), lightCount);
+
 	int loopIteration;
 
 	for (float r = 0.0f; r <= frameTotal-1; r++)
 	{
-		std::vector<SphereObj*> spheresToRender;
+		// Hold the animation step until there is room for another frame
+		frameThrottle.Acquire(frameBytes);
 
 		float frameIncrement = r / FPS;
 		std::vector<SphereObj*> rootSpheres = RetrieveRootSpheres(spheresImported);
@@ -446,32 +1297,46 @@ void PlanetRotation(ConfigurationSettings configSettings, std::vector<SphereObj*
 			rootSphere->UpdateChildren(frameIncrement, rootPos);
 		}
 
-		for each (SphereObj* sphere in spheresImported)
-		{
-			SphereObj* newSphere = new SphereObj();
-
-			newSphere->SetEmissionColour(0.0f);
-			newSphere->SetPosition(sphere->GetPosition());
-			newSphere->SetRadius(sphere->GetRadius());
-			newSphere->SetReflection(1.0f);
-			newSphere->SetRootSphere(sphere->GetRootSphere());
+		// Freeze this frame's spheres, the snapshot is released once the frame is written
+		SceneSnapshot* scene = scenePool.Acquire();
+		scene->Capture(spheresImported, bvhBuilder, hierarchyBuilder);
 
-			if (!newSphere->GetRootSphere())
-			{
-				newSphere->SetParentSphereName(sphere->GetParentSphereName());
-			}
+		if (configSettings.tileRendering)
+		{
+			// Every worker traces tiles of this frame before the next one is started
+			renderTiled(*scene, loopIteration, configSettings, width, height, frameTotal, framebufferPool);
 
-			newSphere->SetRotationSpeed(sphere->GetRotationSpeed());
-			newSphere->SetSphereName(sphere->GetSphereName());
-			newSphere->SetSurfaceColour(sphere->GetSurfaceColour());
-			newSphere->SetTransparency(0.5f);
-			
-			spheresToRender.push_back(newSphere);
+			scenePool.Release(scene);
+			frameThrottle.Release(frameBytes);
+		}
+		else
+		{
+			FrameJob* job = new FrameJob();
+			job->scene = scene;
+			job->scenePool = &scenePool;
+			job->iteration = loopIteration;
+			job->configSettings = &configSettings;
+			job->width = width;
+			job->height = height;
+			job->frameTotal = frameTotal;
+			job->frameThrottle = &frameThrottle;
+			job->frameBytes = frameBytes;
+			job->framebufferPool = &framebufferPool;
+
+			threadManager->AddTask(std::bind(&renderFrameJob, job), frames);
 		}
-
-		std::function<void()> function = std::bind(&render, spheresToRender, loopIteration, configSettings, width, height, frameTotal);
-		threadManager->AddTask(function);
 	}
+
+	// The throttle and pools must outlive every queued frame
+	threadManager->Wait(frames);
+
+	frameLogFile << "\n\nPeak Frame Memory In Flight:\t" << frameThrottle.GetPeakBytesInFlight() / (1024.0 * 1024.0) << " MB";
+	frameLogFile << "\nFramebuffers Allocated:\t\t" << framebufferPool.GetAllocatedCount() << (framebufferPool.UsingLargePages() ? " (large pages)" : "");
+	frameLogFile << "\nSecondary Rays Culled:\t\t" << culledRayTotal.load();
+	frameLogFile << "\nStatic Spheres:\t\t\t" << staticSphereCount << " of " << spheresImported.size();
+	frameLogFile << "\nLights:\t\t\t\t" << lightCount;
+	frameLogFile << "\nBVH Builds / Refits:\t\t" << bvhBuilder.GetRebuildCount() << " / " << bvhBuilder.GetRefitCount();
+	frameLogFile << "\nOrbit Subsystems:\t\t" << hierarchyBuilder.GetSubsystemCount();
 }
 
 #pragma endregion
@@ -610,7 +1475,42 @@ std::string generateFrameLogHeader(ConfigurationSettings configSettings)
 	frameLogHeader += std::to_string(configSettings.length);
 	frameLogHeader += " seconds\n";
 	frameLogHeader += "Frames Per Second:\t" + configSettings.frameRateSetting + "\n";
-	frameLogHeader += "Resolution:\t\t" + configSettings.resolutionSetting + "\n\n";
+	frameLogHeader += "Resolution:\t\t" + configSettings.resolutionSetting + "\n";
+	frameLogHeader += "Render Mode:\t\t";
+	frameLogHeader += configSettings.tileRendering ? "tile (" + std::to_string(configSettings.tileSize) + "px)" : "frame";
+	frameLogHeader += "\n";
+	frameLogHeader += "Worker Threads:\t\t" + std::to_string(threadManager->GetThreadCount());
+	frameLogHeader += configSettings.pinThreads ? " (pinned)\n" : "\n";
+	frameLogHeader += "Intersection Kernel:\t";
+	frameLogHeader += GetSphereKernelName(sphereKernel);
+	frameLogHeader += "\n";
+
+	unsigned packetWidth = 1, packetHeight = 1;
+
+	if (configSettings.rayPackets)
+	{
+		GetRayPacketShape(packetWidth, packetHeight);
+	}
+
+	frameLogHeader += "Primary Rays:\t\t";
+	frameLogHeader += packetWidth * packetHeight > 1 ? std::to_string(packetWidth) + "x" + std::to_string(packetHeight) + " packets" : "single";
+	frameLogHeader += "\n";
+	frameLogHeader += "Trace Mode:\t\t";
+	frameLogHeader += configSettings.wavefrontTracing ? "wavefront" : "recursive";
+	frameLogHeader += "\n";
+	frameLogHeader += "Ray Cutoff:\t\t" + std::to_string(configSettings.contributionCutoff);
+	frameLogHeader += configSettings.russianRoulette ? " (Russian roulette)\n" : "\n";
+	frameLogHeader += "Scene BVH:\t\t";
+	frameLogHeader += configSettings.bvhMinSpheres > 0 ? "from " + std::to_string(configSettings.bvhMinSpheres) + " spheres, rebuilt at " + std::to_string(configSettings.bvhRebuildThreshold) + "x cost" : "off";
+	frameLogHeader += configSettings.bvhMinSpheres > 0 && configSettings.staticBvh ? ", separate static tree\n" : "\n";
+	frameLogHeader += "Orbit Hierarchy:\t";
+	frameLogHeader += configSettings.orbitHierarchy ? "on\n" : "off\n";
+	frameLogHeader += "Screen Binning:\t\t";
+	frameLogHeader += configSettings.screenBinning ? std::to_string(SCREEN_BIN_SIZE) + "px bins\n" : "off\n";
+	frameLogHeader += "Primary Visibility:\t";
+	frameLogHeader += configSettings.rasterizePrimary ? "rasterized\n" : "ray traced\n";
+	frameLogHeader += "Light Sampling:\t\t";
+	frameLogHeader += configSettings.lightSamples > 0 ? std::to_string(configSettings.lightSamples) + " lights per hit from a light tree\n\n" : "every light\n\n";
 
 	frameLogHeader += "===================================================================\n\n";
 
@@ -660,8 +1560,6 @@ std::string generateFrameLogFooter(std::chrono::duration<double> appDuration, st
 //[/comment]
 int main(int argc, char **argv)
 {
-	threadManager = new ThreadManager();
-
 	// This sample only allows one choice per program execution. Feel free to improve upon this
 	srand(13);
 
@@ -675,6 +1573,16 @@ int main(int argc, char **argv)
 		ConfigurationSettings configSettings = ImportSetupFromXMLFile(xmlDocument);
 		HandleSolutionConfiguration(configSettings);
 
+		// Size the worker pool from the configuration or the detected processor count
+		threadManager = new ThreadManager(configSettings.threadCount, configSettings.pinThreads);
+
+		// Use the requested SIMD intersection kernel, falling back to what the processor supports
+		sphereKernel = SelectSphereKernel(ParseSphereKernel(configSettings.intersectionKernel));
+
+		contributionCutoff = configSettings.contributionCutoff;
+		russianRoulette = configSettings.russianRoulette;
+		lightSamples = configSettings.lightSamples;
+
 		// Open stream in file directory
 		frameLogFile.open(configSettings.filePath + "Frame_Log.txt");
 		